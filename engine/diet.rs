@@ -0,0 +1,383 @@
+use std::collections::BTreeMap;
+use std::ops::Range;
+
+/// Discrete Interval Encoding Tree: a set of integers stored as disjoint,
+/// non-adjacent ranges, like the trees in misc/diet*.c. Backed by a map from
+/// the start of every range to its (exclusive) end
+#[derive(Clone, Default)]
+pub struct Diet {
+    ranges: BTreeMap<u32, u32>,
+    /// Ranges separated by a gap of at most this many values are merged on
+    /// insert, gap included. Zero merges only on overlap or adjacency
+    merge_dist: u32,
+}
+
+impl Diet {
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    pub fn with_merge_dist(merge_dist: u32) -> Self {
+        Self {
+            ranges: BTreeMap::new(),
+            merge_dist,
+        }
+    }
+
+    /// Adds `range`, merging it with every range it overlaps or comes within
+    /// `merge_dist` of. Returns whether the set changed
+    pub fn insert(&mut self, range: Range<u32>) -> bool {
+        if range.is_empty() {
+            return false;
+        }
+
+        let mut start = range.start;
+        let mut end = range.end;
+
+        if let Some((&s, &e)) = self.ranges.range(..=start).next_back() {
+            if e >= end {
+                return false;
+            }
+
+            if e.saturating_add(self.merge_dist) >= start {
+                start = s;
+            }
+        }
+
+        let reach = end.saturating_add(self.merge_dist);
+
+        while let Some((&s, &e)) = self.ranges.range(start..=reach).next() {
+            self.ranges.remove(&s);
+            end = end.max(e);
+        }
+
+        self.ranges.insert(start, end);
+
+        true
+    }
+
+    /// Removes `range`, cutting the ranges that stick out of it. The gap
+    /// left behind is kept even if it's narrower than `merge_dist`. Returns
+    /// whether the set changed
+    pub fn remove(&mut self, range: Range<u32>) -> bool {
+        if range.is_empty() {
+            return false;
+        }
+
+        let mut changed = false;
+
+        if let Some((&s, &e)) = self.ranges.range(..range.start).next_back() {
+            if e > range.start {
+                self.ranges.insert(s, range.start);
+
+                if e > range.end {
+                    self.ranges.insert(range.end, e);
+                }
+
+                changed = true;
+            }
+        }
+
+        while let Some((&s, &e)) = self.ranges.range(range.clone()).next() {
+            self.ranges.remove(&s);
+
+            if e > range.end {
+                self.ranges.insert(range.end, e);
+            }
+
+            changed = true;
+        }
+
+        changed
+    }
+
+    /// Merges the ranges across the narrowest gaps until at most `max_ranges`
+    /// are left, so a caller can bound the number of runs it emits
+    pub fn coalesce(&mut self, max_ranges: usize) {
+        let max_ranges = max_ranges.max(1);
+
+        if self.ranges.len() <= max_ranges {
+            return;
+        }
+
+        let ranges: Vec<Range<u32>> = self.iter().collect();
+        let mut gaps: Vec<(u32, usize)> =
+            ranges.windows(2).enumerate().map(|(i, w)| (w[1].start - w[0].end, i)).collect();
+        let mut merge = vec![false; gaps.len()];
+
+        gaps.sort_unstable();
+
+        for &(_, i) in &gaps[..ranges.len() - max_ranges] {
+            merge[i] = true;
+        }
+
+        self.ranges.clear();
+
+        let mut start = ranges[0].start;
+
+        for (i, range) in ranges.iter().enumerate() {
+            if i == merge.len() || !merge[i] {
+                self.ranges.insert(start, range.end);
+
+                if i < merge.len() {
+                    start = ranges[i + 1].start;
+                }
+            }
+        }
+    }
+
+    pub fn len(&self) -> usize {
+        self.ranges.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.ranges.is_empty()
+    }
+
+    pub fn iter(&self) -> impl Iterator<Item = Range<u32>> + '_ {
+        self.ranges.iter().map(|(&s, &e)| s..e)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::rand::Wyhash64;
+
+    const LEN: u32 = 64;
+
+    /// The set as one flag per value in `0..LEN`
+    fn bitmap(diet: &Diet) -> Vec<bool> {
+        let mut bits = vec![false; LEN as usize];
+
+        for value in diet.iter().flatten() {
+            bits[value as usize] = true;
+        }
+
+        bits
+    }
+
+    /// Ranges are non-empty, in order, and at least one value apart, so
+    /// they are exactly the runs of the bitmap
+    fn check_ranges(diet: &Diet) {
+        let mut prev_end = None;
+
+        for range in diet.iter() {
+            assert!(range.start < range.end, "empty range {:?}", range);
+
+            if let Some(end) = prev_end {
+                assert!(end < range.start, "{:?} touches the range before", range);
+            }
+
+            prev_end = Some(range.end);
+        }
+    }
+
+    /// Up to 7 values long, sometimes empty
+    fn random_range(rng: &mut Wyhash64) -> Range<u32> {
+        let start = rng.gen_in_range(0..u64::from(LEN)) as u32;
+        let len = rng.gen_in_range(0..8) as u32;
+
+        start..(start + len).min(LEN)
+    }
+
+    fn ranges(diet: &Diet) -> Vec<Range<u32>> {
+        diet.iter().collect()
+    }
+
+    #[test]
+    fn touching_and_overlapping() {
+        let mut diet = Diet::new();
+
+        assert!(diet.insert(0..4));
+        assert!(diet.insert(4..8));
+        assert_eq!(ranges(&diet), [0..8]);
+
+        assert!(diet.insert(10..12));
+        assert!(diet.insert(11..15));
+        assert_eq!(ranges(&diet), [0..8, 10..15]);
+
+        // Touches the right range only, 8 stays a gap
+        assert!(diet.insert(9..10));
+        assert_eq!(ranges(&diet), [0..8, 9..15]);
+
+        assert!(diet.insert(8..9));
+        assert_eq!(ranges(&diet), [0..15]);
+
+        assert!(!diet.insert(3..5));
+        assert!(!diet.insert(0..15));
+        assert!(!diet.insert(20..20));
+        assert_eq!(ranges(&diet), [0..15]);
+    }
+
+    #[test]
+    fn remove_splits() {
+        let mut diet = Diet::new();
+
+        diet.insert(0..10);
+
+        assert!(diet.remove(3..5));
+        assert_eq!(ranges(&diet), [0..3, 5..10]);
+
+        assert!(!diet.remove(3..5));
+        assert!(!diet.remove(10..12));
+        assert!(!diet.remove(7..7));
+
+        // Cuts the end of one range and the start of the next
+        assert!(diet.remove(2..6));
+        assert_eq!(ranges(&diet), [0..2, 6..10]);
+
+        assert!(diet.remove(0..10));
+        assert!(diet.is_empty());
+    }
+
+    #[test]
+    fn matches_bitmap() {
+        for seed in 0..20 {
+            let mut rng = Wyhash64::from_seed(seed);
+            let mut diet = Diet::new();
+            let mut model = vec![false; LEN as usize];
+
+            for _ in 0..500 {
+                let range = random_range(&mut rng);
+                let set = rng.gen_in_range(0..2) == 0;
+                let mut changed = false;
+
+                for value in range.clone() {
+                    changed |= model[value as usize] != set;
+                    model[value as usize] = set;
+                }
+
+                let reported = if set {
+                    diet.insert(range.clone())
+                } else {
+                    diet.remove(range.clone())
+                };
+
+                assert_eq!(reported, changed, "seed {} set {} {:?}", seed, set, range);
+                assert_eq!(bitmap(&diet), model, "seed {} set {} {:?}", seed, set, range);
+                check_ranges(&diet);
+            }
+        }
+    }
+
+    #[test]
+    fn merge_dist_at_exact_gap() {
+        let mut diet = Diet::with_merge_dist(3);
+
+        // A gap of exactly merge_dist values is filled, one more isn't
+        diet.insert(0..2);
+        assert!(diet.insert(5..6));
+        assert_eq!(ranges(&diet), [0..6]);
+
+        assert!(diet.insert(10..12));
+        assert_eq!(ranges(&diet), [0..6, 10..12]);
+
+        // Same on the left of the new range
+        assert!(diet.insert(15..16));
+        assert_eq!(ranges(&diet), [0..6, 10..16]);
+
+        // Inside a filled gap is already in the set
+        assert!(!diet.insert(3..4));
+
+        // A narrow gap left by remove stays
+        assert!(diet.remove(2..4));
+        assert_eq!(ranges(&diet), [0..2, 4..6, 10..16]);
+    }
+
+    #[test]
+    fn merge_dist_matches_model() {
+        for merge_dist in [1, 2, 5] {
+            for seed in 0..20 {
+                let mut rng = Wyhash64::from_seed(seed);
+                let mut diet = Diet::with_merge_dist(merge_dist);
+                let mut model = vec![false; LEN as usize];
+
+                for _ in 0..100 {
+                    let range = random_range(&mut rng);
+                    let old = model.clone();
+
+                    for value in range.clone() {
+                        model[value as usize] = true;
+                    }
+
+                    // Every gap between ranges was wider than merge_dist,
+                    // so the only narrow ones are next to the new range
+                    fill_narrow_gaps(&mut model, merge_dist);
+
+                    assert_eq!(diet.insert(range.clone()), model != old, "{:?}", range);
+                    assert_eq!(bitmap(&diet), model, "merge_dist {} seed {}", merge_dist, seed);
+
+                    for w in ranges(&diet).windows(2) {
+                        assert!(w[1].start - w[0].end > merge_dist);
+                    }
+                }
+            }
+        }
+    }
+
+    /// Sets the runs of clear values at most `merge_dist` long that have set
+    /// values on both sides
+    fn fill_narrow_gaps(bits: &mut [bool], merge_dist: u32) {
+        let mut last_set = None;
+
+        for i in 0..bits.len() {
+            if !bits[i] {
+                continue;
+            }
+
+            if let Some(last) = last_set {
+                if i - last - 1 <= merge_dist as usize {
+                    bits[last..i].fill(true);
+                }
+            }
+
+            last_set = Some(i);
+        }
+    }
+
+    #[test]
+    fn coalesce_covers_and_bounds() {
+        for seed in 0..50 {
+            let mut rng = Wyhash64::from_seed(seed);
+            let mut diet = Diet::new();
+
+            for _ in 0..rng.gen_in_range(0..20) {
+                diet.insert(random_range(&mut rng));
+            }
+
+            let original = ranges(&diet);
+            let mut gaps: Vec<u32> =
+                original.windows(2).map(|w| w[1].start - w[0].end).collect();
+
+            gaps.sort_unstable();
+
+            for max_ranges in 1..=original.len() + 1 {
+                let mut coalesced = diet.clone();
+
+                coalesced.coalesce(max_ranges);
+
+                let result = ranges(&coalesced);
+                let merged = original.len().saturating_sub(max_ranges.max(1));
+
+                assert_eq!(result.len(), original.len() - merged);
+
+                // Every value is still covered, and runs only grow over
+                // whole gaps, the narrowest ones
+                for (old, new) in bitmap(&diet).iter().zip(bitmap(&coalesced)) {
+                    assert!(!old || new);
+                }
+
+                for range in &result {
+                    assert!(original.iter().any(|r| r.start == range.start));
+                    assert!(original.iter().any(|r| r.end == range.end));
+                }
+
+                let added = coalesced.iter().map(|r| r.len()).sum::<usize>()
+                    - diet.iter().map(|r| r.len()).sum::<usize>();
+
+                assert_eq!(added, gaps[..merged].iter().sum::<u32>() as usize);
+            }
+        }
+    }
+}
@@ -22,6 +22,7 @@ pub mod window;
 pub mod world;
 
 mod camera;
+mod diet;
 mod image;
 mod input;
 mod rand;
@@ -1026,11 +1026,15 @@ impl ComputeTarget {
         (self.update_data_cb)(self, camera, world, current_frame);
     }
 
-    pub fn copy_to_buffer(&mut self, idx: usize, data: &[u32]) {
-        let mapping = self.buffers[idx].mapping;
+    /// Copies `data` into buffer `idx` starting at element `offset`
+    pub fn copy_to_buffer(&mut self, idx: usize, offset: usize, data: &[u32]) {
+        let buffer = &self.buffers[idx];
+        let end = (offset + data.len()) * size_of::<u32>();
+
+        assert!(end as u64 <= buffer.size, "copy out of bounds: {} > {}", end, buffer.size);
 
         unsafe {
-            mapping.copy_from_nonoverlapping(data.as_ptr(), data.len());
+            buffer.mapping.add(offset).copy_from_nonoverlapping(data.as_ptr(), data.len());
         }
     }
 }
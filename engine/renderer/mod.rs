@@ -32,6 +32,9 @@ pub const SIZE_F32: u32 = to_u32(size_of::<f32>());
 
 pub const DRAW_TIMEOUT_NS: u64 = 5 * 1000 * 1000 * 1000;
 
+/// Most copies issued per world buffer in one upload
+const MAX_UPLOAD_COPIES: usize = 64;
+
 pub struct Renderer {
     instance: ash::Instance,
     debug_data: Option<DebugData>,
@@ -87,7 +90,7 @@ pub struct RayCastPushConstants {
     world_size_x: u32,
     world_size_y: u32,
     world_size_z: u32,
-    pad2: f32,
+    world_span_rows: u32,
 }
 
 #[repr(C, packed)]
@@ -476,6 +479,7 @@ impl Renderer {
             world_size_x: world.size_x(),
             world_size_y: world.size_y(),
             world_size_z: world.size_z(),
+            world_span_rows: world.span_rows(),
             ..Default::default()
         };
 
@@ -496,8 +500,18 @@ impl Renderer {
                 }
 
                 if world.needs_upload() {
-                    ct.copy_to_buffer(0, world.sizes());
-                    ct.copy_to_buffer(1, world.spans());
+                    world.coalesce_dirty(MAX_UPLOAD_COPIES);
+
+                    for range in world.dirty_sizes() {
+                        let range = range.start as usize..range.end as usize;
+                        ct.copy_to_buffer(0, range.start, &world.sizes()[range]);
+                    }
+
+                    for range in world.dirty_spans() {
+                        let range = range.start as usize..range.end as usize;
+                        ct.copy_to_buffer(1, range.start, &world.spans()[range]);
+                    }
+
                     world.uploaded();
                 }
             };
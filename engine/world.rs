@@ -1,5 +1,6 @@
 use std::ops::Range;
 
+use crate::diet::Diet;
 use crate::rand;
 use crate::utils::*;
 
@@ -7,14 +8,28 @@ pub const MAX_SIZE_X: u32 = 256;
 pub const MAX_SIZE_Y: u32 = 256;
 pub const MAX_SIZE_Z: u32 = 256;
 
+/// Dirty elements this close together are uploaded with one copy, clean
+/// elements in between included
+const UPLOAD_MERGE_DIST: u32 = 16;
+
 pub struct World {
     sx: u32,
     sy: u32,
     sz: u32,
+    /// Solid voxels of every column as ranges of y, indexed like `sizes`
+    columns: Vec<Diet>,
     /// A 2-dimensional array of length of every span list
     sizes: Vec<u32>,
-    /// A 3-dimensional array of `(top, bot): (u32, u32)`
+    /// A 3-dimensional array of `(top, bot): (u32, u32)`, `span_rows()`
+    /// elements high
     spans: Vec<u32>,
+    /// Columns edited since the last upload, and a flag per column to keep
+    /// the list free of duplicates
+    changed_columns: Vec<u32>,
+    column_changed: Vec<bool>,
+    /// Ranges of `sizes` and `spans` elements modified since the last upload
+    dirty_sizes: Diet,
+    dirty_spans: Diet,
     needs_upload: bool,
 }
 
@@ -25,12 +40,6 @@ struct Array3D<T: Copy> {
     data: Vec<T>,
 }
 
-struct Array2D<T: Copy> {
-    sx: usize,
-    sy: usize,
-    data: Vec<T>,
-}
-
 impl World {
     pub fn new(sx: usize, sy: usize, sz: usize) -> Self {
         let mut arr = Array3D::new(0, sx, sy, sz);
@@ -41,24 +50,17 @@ impl World {
     }
 
     fn from_array(arr: &Array3D<u32>) -> Self {
-        let mut sizes = Array2D::new(0, arr.sx, arr.sz);
-        let mut spans = Array3D::new(0, arr.sx, arr.sy, arr.sz);
+        let mut columns = vec![Diet::new(); arr.sx * arr.sz];
 
         for x in 0..arr.sx {
             for z in 0..arr.sz {
+                let column = &mut columns[z * arr.sx + x];
                 let mut start = if arr.get(x, 0, z) > 0 { Some(0) } else { None };
 
                 for y in 1..arr.sy {
                     if arr.get(x, y, z) == 0 {
                         if let Some(bot) = start {
-                            let len = sizes.as_mut(x, z);
-                            let i = (*len) as usize;
-                            let top = to_u32(y);
-
-                            spans.set(x, i * 2, z, bot);
-                            spans.set(x, i * 2 + 1, z, top);
-
-                            *len += 1;
+                            column.insert(bot..to_u32(y));
 
                             start = None;
                         }
@@ -69,16 +71,136 @@ impl World {
             }
         }
 
-        Self {
+        // Room for every span a column can hold, see `span_rows`
+        let span_rows = arr.sy.div_ceil(2) * 2;
+
+        let mut world = Self {
             sx: to_u32(arr.sx),
             sy: to_u32(arr.sy),
             sz: to_u32(arr.sz),
-            spans: spans.data,
-            sizes: sizes.data,
+            columns,
+            sizes: vec![0; arr.sx * arr.sz],
+            spans: vec![0; arr.sx * span_rows * arr.sz],
+            changed_columns: Vec::new(),
+            column_changed: vec![false; arr.sx * arr.sz],
+            dirty_sizes: Diet::with_merge_dist(UPLOAD_MERGE_DIST),
+            dirty_spans: Diet::with_merge_dist(UPLOAD_MERGE_DIST),
             needs_upload: true,
+        };
+
+        // Nothing is on the GPU yet
+        world.dirty_sizes.insert(0..to_u32(world.sizes.len()));
+        world.dirty_spans.insert(0..to_u32(world.spans.len()));
+
+        for z in 0..world.sz {
+            for x in 0..world.sx {
+                world.write_column(x, z);
+            }
+        }
+
+        world
+    }
+
+    /// Makes voxels `ys` of column (x, z) solid
+    pub fn set_range(&mut self, x: u32, z: u32, ys: Range<u32>) {
+        self.assert_column_bounds(x, z, &ys);
+
+        let idx = self.column_index(x, z);
+
+        if self.columns[idx].insert(ys) {
+            self.column_edited(x, z);
+        }
+    }
+
+    /// Makes voxels `ys` of column (x, z) empty
+    pub fn clear_range(&mut self, x: u32, z: u32, ys: Range<u32>) {
+        self.assert_column_bounds(x, z, &ys);
+
+        let idx = self.column_index(x, z);
+
+        if self.columns[idx].remove(ys) {
+            self.column_edited(x, z);
+        }
+    }
+
+    /// Indices into `sizes` of the columns edited since the last upload, in
+    /// the order they were first edited
+    pub fn changed_columns(&self) -> &[u32] {
+        &self.changed_columns
+    }
+
+    fn column_edited(&mut self, x: u32, z: u32) {
+        let idx = self.column_index(x, z);
+
+        self.write_column(x, z);
+
+        if !self.column_changed[idx] {
+            self.column_changed[idx] = true;
+            self.changed_columns.push(to_u32(idx));
+        }
+
+        self.needs_upload = true;
+    }
+
+    /// Widens the dirty runs of each buffer until there are at most
+    /// `max_copies` of them, trading redundant elements for fewer copies
+    pub fn coalesce_dirty(&mut self, max_copies: usize) {
+        self.dirty_sizes.coalesce(max_copies);
+        self.dirty_spans.coalesce(max_copies);
+    }
+
+    /// Elements of `sizes` modified since the last upload, as coalesced runs
+    pub fn dirty_sizes(&self) -> impl Iterator<Item = Range<u32>> + '_ {
+        self.dirty_sizes.iter()
+    }
+
+    /// Elements of `spans` modified since the last upload, as coalesced runs
+    pub fn dirty_spans(&self) -> impl Iterator<Item = Range<u32>> + '_ {
+        self.dirty_spans.iter()
+    }
+
+    /// Rewrites the span list of column (x, z) in `sizes` and `spans` from
+    /// its interval set, marking the elements that changed as dirty. Entries
+    /// past the new span count are left stale, the shader never reads them
+    fn write_column(&mut self, x: u32, z: u32) {
+        let idx = self.column_index(x, z);
+        let column = &self.columns[idx];
+        let num_spans = column.len();
+
+        let span_rows = self.span_rows() as usize;
+
+        assert!(num_spans * 2 <= span_rows, "too many spans in column ({}, {})", x, z);
+
+        let sx = self.sx as usize;
+        let base = z as usize * span_rows * sx + x as usize;
+
+        for (i, span) in column.iter().enumerate() {
+            for (j, val) in [(i * 2, span.start), (i * 2 + 1, span.end)] {
+                let k = base + j * sx;
+
+                if self.spans[k] != val {
+                    self.spans[k] = val;
+                    self.dirty_spans.insert(to_u32(k)..to_u32(k + 1));
+                }
+            }
+        }
+
+        if self.sizes[idx] != to_u32(num_spans) {
+            self.sizes[idx] = to_u32(num_spans);
+            self.dirty_sizes.insert(to_u32(idx)..to_u32(idx + 1));
         }
     }
 
+    fn column_index(&self, x: u32, z: u32) -> usize {
+        z as usize * self.sx as usize + x as usize
+    }
+
+    fn assert_column_bounds(&self, x: u32, z: u32, ys: &Range<u32>) {
+        assert!(x < self.sx, "x out of bounds: {} >= {}", x, self.sx);
+        assert!(z < self.sz, "z out of bounds: {} >= {}", z, self.sz);
+        assert!(ys.end <= self.sy, "y out of bounds: {} > {}", ys.end, self.sy);
+    }
+
     pub fn size_x(&self) -> u32 {
         self.sx
     }
@@ -91,6 +213,12 @@ impl World {
         self.sz
     }
 
+    /// Elements per column in `spans`. A column of odd height can hold
+    /// `(sy + 1) / 2` disjoint spans, one element more than `sy`
+    pub fn span_rows(&self) -> u32 {
+        self.sy.div_ceil(2) * 2
+    }
+
     pub fn sizes(&self) -> &[u32] {
         &self.sizes
     }
@@ -104,6 +232,13 @@ impl World {
     }
 
     pub fn uploaded(&mut self) {
+        for &idx in &self.changed_columns {
+            self.column_changed[idx as usize] = false;
+        }
+
+        self.changed_columns.clear();
+        self.dirty_sizes = Diet::with_merge_dist(UPLOAD_MERGE_DIST);
+        self.dirty_spans = Diet::with_merge_dist(UPLOAD_MERGE_DIST);
         self.needs_upload = false;
     }
 }
@@ -187,25 +322,155 @@ impl Array3D<u32> {
     }
 }
 
-impl<T: Copy> Array2D<T> {
-    fn new(init: T, sx: usize, sy: usize) -> Self {
-        let data = vec![init; sx * sy];
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    const SX: usize = 8;
+    const SY: usize = 16;
+    const SZ: usize = 8;
+
+    /// Voxels 2 to 4 of every column solid, with the initial upload done
+    fn uploaded_world() -> World {
+        let mut arr = Array3D::new(0, SX, SY, SZ);
+
+        for x in 0..SX {
+            for z in 0..SZ {
+                for y in 2..5 {
+                    arr.set(x, y, z, 1);
+                }
+            }
+        }
+
+        let mut world = World::from_array(&arr);
 
-        Self { sx, sy, data }
+        world.uploaded();
+        world
     }
 
-    fn as_mut(&mut self, x: usize, y: usize) -> &mut T {
-        self.assert_size_bounds(x, y);
-        &mut self.data[y * self.sx + x]
+    /// Indices of the elements that differ between two copies of a buffer
+    fn changed(old: &[u32], new: &[u32]) -> Vec<usize> {
+        (0..old.len()).filter(|&k| old[k] != new[k]).collect()
     }
 
-    fn assert_size_bounds(&self, x: usize, y: usize) {
-        assert!(x < self.sx, "x out of bounds: {} >= {}", x, self.sx);
-        assert!(y < self.sy, "y out of bounds: {} >= {}", y, self.sy);
+    #[test]
+    fn block_edit_marks_one_column() {
+        let mut world = uploaded_world();
+        let old_spans = world.spans().to_vec();
+        let (x, z) = (3, 5);
+        let idx = world.column_index(x, z);
+
+        world.set_range(x, z, 8..9);
+
+        assert_eq!(world.changed_columns(), [to_u32(idx)]);
+        assert!(world.needs_upload());
+        assert_eq!(world.sizes()[idx], 2);
+        assert_eq!(world.dirty_sizes().collect::<Vec<_>>(), [to_u32(idx)..to_u32(idx + 1)]);
+
+        // Only the new span's two elements changed, both in the column
+        let base = z as usize * SY * SX + x as usize;
+
+        assert_eq!(changed(&old_spans, world.spans()), [base + 2 * SX, base + 3 * SX]);
+
+        // Neither the same edit again nor one that changes nothing is listed
+        world.set_range(x, z, 8..9);
+        world.set_range(0, 0, 2..5);
+
+        assert_eq!(world.changed_columns(), [to_u32(idx)]);
+
+        world.uploaded();
+
+        assert!(world.changed_columns().is_empty());
+        assert!(!world.needs_upload());
+        assert_eq!(world.dirty_sizes().count(), 0);
+        assert_eq!(world.dirty_spans().count(), 0);
+    }
+
+    #[test]
+    fn clear_range_splits_a_span() {
+        let mut world = uploaded_world();
+        let (x, z) = (6, 1);
+        let idx = world.column_index(x, z);
+        let base = z as usize * SY * SX + x as usize;
+
+        world.clear_range(x, z, 3..4);
+
+        assert_eq!(world.changed_columns(), [to_u32(idx)]);
+        assert_eq!(world.sizes()[idx], 2);
+
+        let spans: Vec<u32> = (0..4).map(|j| world.spans()[base + j * SX]).collect();
+
+        assert_eq!(spans, [2, 3, 4, 5]);
+    }
+
+    #[test]
+    fn odd_height_fits_every_span() {
+        let mut world = World::from_array(&Array3D::new(0, SX, 5, SZ));
+        let (x, z) = (2, 7);
+        let idx = world.column_index(x, z);
+        let base = z as usize * world.span_rows() as usize * SX + x as usize;
+
+        for y in [0, 2, 4] {
+            world.set_range(x, z, y..y + 1);
+        }
+
+        assert_eq!(world.span_rows(), 6);
+        assert_eq!(world.sizes()[idx], 3);
+
+        let spans: Vec<u32> = (0..6).map(|j| world.spans()[base + j * SX]).collect();
+
+        assert_eq!(spans, [0, 1, 2, 3, 4, 5]);
+    }
+
+    /// Copies the dirty runs into the buffers the GPU would hold, like the
+    /// renderer's upload
+    fn upload(world: &mut World, gpu_sizes: &mut [u32], gpu_spans: &mut [u32]) {
+        for r in world.dirty_sizes() {
+            let r = r.start as usize..r.end as usize;
+
+            gpu_sizes[r.clone()].copy_from_slice(&world.sizes()[r]);
+        }
+
+        for r in world.dirty_spans() {
+            let r = r.start as usize..r.end as usize;
+
+            gpu_spans[r.clone()].copy_from_slice(&world.spans()[r]);
+        }
+
+        world.uploaded();
     }
 
-    fn set(&mut self, x: usize, y: usize, val: T) {
-        self.assert_size_bounds(x, y);
-        self.data[y * self.sx + x] = val;
+    #[test]
+    fn coalesced_runs_cover_every_change() {
+        let mut world = uploaded_world();
+        let mut gpu_sizes = world.sizes().to_vec();
+        let mut gpu_spans = world.spans().to_vec();
+        let mut rng = crate::rand::Wyhash64::from_seed(7);
+        let max_copies = 4;
+
+        for _ in 0..100 {
+            for _ in 0..rng.gen_in_range(1..10) {
+                let x = rng.gen_in_range(0..SX as u64) as u32;
+                let z = rng.gen_in_range(0..SZ as u64) as u32;
+                let y = rng.gen_in_range(0..SY as u64 - 1) as u32;
+                let ys = y..y + 1 + rng.gen_in_range(0..2) as u32;
+
+                if rng.gen_in_range(0..2) == 0 {
+                    world.set_range(x, z, ys);
+                } else {
+                    world.clear_range(x, z, ys);
+                }
+            }
+
+            world.coalesce_dirty(max_copies);
+
+            assert!(world.dirty_sizes().count() <= max_copies);
+            assert!(world.dirty_spans().count() <= max_copies);
+
+            upload(&mut world, &mut gpu_sizes, &mut gpu_spans);
+
+            assert_eq!(gpu_sizes, world.sizes());
+            assert_eq!(gpu_spans, world.spans());
+        }
     }
 }
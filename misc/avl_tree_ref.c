@@ -1,13 +1,21 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
+#ifndef N
 #define N 1000
+#endif
 #define i16 int16_t
 
 #define T INT16_MAX
@@ -21,11 +29,54 @@ struct node {
     i16 right;
     i16 parent;
     i16 height;
+    i16 size;
+};
+
+// Order-statistic tree over the high endpoints, used for counting queries.
+// Shares indices with `nodes`: highs[i] holds nodes[i].high
+struct endpoint {
+    i16 key;
+    i16 left;
+    i16 right;
+    i16 height;
+    i16 size;
+};
+
+// A query for the batched sweep. `first` and `count` locate the answer in
+// the shared results buffer
+struct query {
+    i16 low;
+    i16 high;
+    int first;
+    int count;
+};
+
+struct interval {
+    i16 low;
+    i16 high;
+};
+
+// One thread of the parallel query engine. Answers queries [begin, end)
+// into its own results buffer, so `first` is relative to that buffer
+struct worker {
+    pthread_t thread;
+    struct query* queries;
+    int begin;
+    int end;
+    i16* results;
+    int rlen;
+    int rcap;
 };
 
 i16 root = T;
+i16 high_root = T;
 i16 len = 0;
 struct node nodes[N];
+struct endpoint highs[N];
+
+#ifdef STATS
+struct stats stats;
+#endif
 
 void init_node(i16 i, i16 low, i16 high)
 {
@@ -36,6 +87,7 @@ void init_node(i16 i, i16 low, i16 high)
     nodes[i].right = T;
     nodes[i].parent = T;
     nodes[i].height = 1;
+    nodes[i].size = 1;
 }
 
 i16 height(i16 x)
@@ -59,6 +111,19 @@ void update_height(i16 x)
     nodes[x].height = 1 + max(lh, rh);
 }
 
+i16 size(i16 x)
+{
+    if (x == T)
+        return 0;
+
+    return nodes[x].size;
+}
+
+void update_size(i16 x)
+{
+    nodes[x].size = 1 + size(nodes[x].left) + size(nodes[x].right);
+}
+
 void update_max(i16 x)
 {
     i16 lm = nodes[x].left == T ? MIN : nodes[nodes[x].left].max;
@@ -71,6 +136,8 @@ i16 right_rotate(i16 x)
 {
     i16 y = nodes[x].left;
 
+    STAT(stats.rotations++);
+
     nodes[x].left = nodes[y].right;
 
     if (nodes[y].right != T)
@@ -94,6 +161,9 @@ i16 right_rotate(i16 x)
     update_max(x);
     update_max(y);
 
+    update_size(x);
+    update_size(y);
+
     return y;
 }
 
@@ -101,6 +171,8 @@ i16 left_rotate(i16 x)
 {
     i16 y = nodes[x].right;
 
+    STAT(stats.rotations++);
+
     nodes[x].right = nodes[y].left;
 
     if (nodes[y].left != T)
@@ -124,6 +196,9 @@ i16 left_rotate(i16 x)
     update_max(x);
     update_max(y);
 
+    update_size(x);
+    update_size(y);
+
     return y;
 }
 
@@ -147,17 +222,124 @@ i16 balance(i16 x)
 
     update_height(x);
     update_max(x);
+    update_size(x);
+
+    return x;
+}
+
+i16 ep_height(i16 x)
+{
+    if (x == T)
+        return 0;
+
+    return highs[x].height;
+}
+
+i16 ep_size(i16 x)
+{
+    if (x == T)
+        return 0;
+
+    return highs[x].size;
+}
+
+void ep_update(i16 x)
+{
+    i16 l = highs[x].left;
+    i16 r = highs[x].right;
+
+    highs[x].height = 1 + max(ep_height(l), ep_height(r));
+    highs[x].size = 1 + ep_size(l) + ep_size(r);
+}
+
+i16 ep_right_rotate(i16 x)
+{
+    i16 y = highs[x].left;
+
+    highs[x].left = highs[y].right;
+    highs[y].right = x;
+
+    ep_update(x);
+    ep_update(y);
+
+    return y;
+}
+
+i16 ep_left_rotate(i16 x)
+{
+    i16 y = highs[x].right;
+
+    highs[x].right = highs[y].left;
+    highs[y].left = x;
+
+    ep_update(x);
+    ep_update(y);
+
+    return y;
+}
+
+i16 ep_balance(i16 x)
+{
+    ep_update(x);
+
+    i16 d = ep_height(highs[x].right) - ep_height(highs[x].left);
+
+    if (d > 1) {
+        i16 r = highs[x].right;
+
+        if (ep_height(highs[r].right) < ep_height(highs[r].left))
+            highs[x].right = ep_right_rotate(r);
+
+        return ep_left_rotate(x);
+    }
+
+    if (d < -1) {
+        i16 l = highs[x].left;
+
+        if (ep_height(highs[l].left) < ep_height(highs[l].right))
+            highs[x].left = ep_left_rotate(l);
+
+        return ep_right_rotate(x);
+    }
 
     return x;
 }
 
+i16 ep_insert(i16 x, i16 n)
+{
+    if (x == T)
+        return n;
+
+    if (highs[n].key < highs[x].key)
+        highs[x].left = ep_insert(highs[x].left, n);
+    else
+        highs[x].right = ep_insert(highs[x].right, n);
+
+    return ep_balance(x);
+}
+
+void insert_high(i16 n, i16 high)
+{
+    highs[n].key = high;
+    highs[n].left = T;
+    highs[n].right = T;
+    highs[n].height = 1;
+    highs[n].size = 1;
+
+    high_root = ep_insert(high_root, n);
+}
+
 void insert(i16 low, i16 high)
 {
     i16 n = len++;
     init_node(n, low, high);
+    insert_high(n, high);
+
+    STAT(stats.nodes++);
 
     if (root == T) {
         root = n;
+        STAT(stat_insert_done(&stats));
         return;
     }
 
@@ -166,6 +348,7 @@ void insert(i16 low, i16 high)
 
     while (x != T) {
         p = x;
+        STAT(stats.insert_depth++);
 
         if (low < nodes[x].low)
             x = nodes[x].left;
@@ -188,7 +371,8 @@ void insert(i16 low, i16 high)
     }
 
     root = x;
-    return;
+
+    STAT(stat_insert_done(&stats));
 }
 
 bool overlap(i16 x0, i16 x1, i16 y0, i16 y1)
@@ -212,6 +396,118 @@ i16 search(i16 low, i16 high)
     return x;
 }
 
+// The overlapping interval with the smallest low. If the left subtree
+// reaches low but holds no overlap, its interval reaching low starts after
+// high, and so does everything to its right, so one descent suffices
+i16 search_leftmost(i16 low, i16 high)
+{
+    i16 x = root;
+
+    while (x != T) {
+        i16 left = nodes[x].left;
+
+        if (left != T && nodes[left].max >= low)
+            x = left;
+        else if (overlap(low, high, nodes[x].low, nodes[x].high))
+            return x;
+        else if (nodes[x].low > high)
+            return T;
+        else
+            x = nodes[x].right;
+    }
+
+    return T;
+}
+
+// The overlapping interval with the largest low. Walking towards high, every
+// node starting at or before high and its left subtree are candidates; the
+// last one that reaches low wins. If that is a subtree, a second descent
+// picks its rightmost interval reaching low
+i16 search_rightmost(i16 low, i16 high)
+{
+    i16 x = root;
+    i16 best = T;
+    bool subtree = false;
+
+    while (x != T) {
+        i16 left = nodes[x].left;
+
+        if (nodes[x].low > high) {
+            x = left;
+            continue;
+        }
+
+        if (nodes[x].high >= low) {
+            best = x;
+            subtree = false;
+        } else if (left != T && nodes[left].max >= low) {
+            best = left;
+            subtree = true;
+        }
+
+        x = nodes[x].right;
+    }
+
+    if (!subtree)
+        return best;
+
+    x = best;
+
+    while (1) {
+        i16 right = nodes[x].right;
+
+        if (right != T && nodes[right].max >= low)
+            x = right;
+        else if (nodes[x].high >= low)
+            return x;
+        else
+            x = nodes[x].left;
+    }
+}
+
+// Number of intervals with low > b
+i16 count_low_above(i16 b)
+{
+    i16 x = root;
+    i16 count = 0;
+
+    while (x != T) {
+        if (nodes[x].low > b) {
+            count += 1 + size(nodes[x].right);
+            x = nodes[x].left;
+        } else {
+            x = nodes[x].right;
+        }
+    }
+
+    return count;
+}
+
+// Number of intervals with high < a
+i16 count_high_below(i16 a)
+{
+    i16 x = high_root;
+    i16 count = 0;
+
+    while (x != T) {
+        if (highs[x].key < a) {
+            count += 1 + ep_size(highs[x].left);
+            x = highs[x].right;
+        } else {
+            x = highs[x].left;
+        }
+    }
+
+    return count;
+}
+
+// An interval misses [low, high] iff it ends before low or starts after high.
+// Both can't happen at once, so the overlaps are whatever is left
+i16 count_overlapping(i16 low, i16 high)
+{
+    return len - count_high_below(low) - count_low_above(high);
+}
+
 void find_all_overlapping(i16 x, i16 low, i16 high, i16* results, i16* rlen)
 {
     if (x == T)
@@ -227,6 +523,200 @@ void find_all_overlapping(i16 x, i16 low, i16 high, i16* results, i16* rlen)
         find_all_overlapping(nodes[x].right, low, high, results, rlen);
 }
 
+void gather_sorted(i16 x, i16* sorted, i16* slen)
+{
+    if (x == T)
+        return;
+
+    gather_sorted(nodes[x].left, sorted, slen);
+    sorted[(*slen)++] = x;
+    gather_sorted(nodes[x].right, sorted, slen);
+}
+
+int compare_queries(const void* a, const void* b)
+{
+    const struct query* qa = a;
+    const struct query* qb = b;
+
+    return qa->low - qb->low;
+}
+
+// Answers all queries in one sweep over the intervals sorted by low.
+// Queries are sorted in place by low, so every interval enters the active
+// list once and leaves it once, and the whole batch costs
+// O(n + m log m + k). `results` must hold the sum of all answers, which
+// count_overlapping() can tell in advance
+void find_all_overlapping_batch(struct query* queries, int num_queries, i16* results)
+{
+    i16 *sorted = malloc(N * sizeof(i16));
+    i16 *active = malloc(N * sizeof(i16));
+    i16 slen = 0;
+    i16 alen = 0;
+    i16 next = 0;
+    int out = 0;
+
+    gather_sorted(root, sorted, &slen);
+
+    qsort(queries, num_queries, sizeof(struct query), compare_queries);
+
+    for (int q = 0; q < num_queries; ++q) {
+        i16 low = queries[q].low;
+        i16 high = queries[q].high;
+
+        while (next < slen && nodes[sorted[next]].low < low)
+            active[alen++] = sorted[next++];
+
+        queries[q].first = out;
+
+        // Everything active starts before low, so it overlaps iff it
+        // reaches low. The rest has expired for all remaining queries
+        i16 kept = 0;
+
+        for (i16 i = 0; i < alen; ++i)
+            if (nodes[active[i]].high >= low) {
+                active[kept++] = active[i];
+                results[out++] = active[i];
+            }
+
+        alen = kept;
+
+        for (i16 i = next; i < slen && nodes[sorted[i]].low <= high; ++i)
+            results[out++] = sorted[i];
+
+        queries[q].count = out - queries[q].first;
+    }
+
+    free(sorted);
+    free(active);
+}
+
+void* query_worker(void* arg)
+{
+    struct worker* w = arg;
+
+    w->rlen = 0;
+
+    for (int q = w->begin; q < w->end; ++q) {
+        // A single query can't return more than every interval
+        if (w->rcap - w->rlen < len) {
+            w->rcap = max(2 * w->rcap, w->rlen + len);
+            w->results = realloc(w->results, w->rcap * sizeof(i16));
+        }
+
+        i16 count = 0;
+
+        find_all_overlapping(root, w->queries[q].low, w->queries[q].high,
+                w->results + w->rlen, &count);
+
+        w->queries[q].first = w->rlen;
+        w->queries[q].count = count;
+        w->rlen += count;
+    }
+
+    return NULL;
+}
+
+// Splits the queries evenly between threads. The tree is only read, so the
+// threads share it without locking. Worker buffers are kept between calls
+// and must be zeroed before the first one
+void find_all_overlapping_parallel(struct query* queries, int num_queries,
+        struct worker* workers, int num_threads)
+{
+    int chunk = (num_queries + num_threads - 1) / num_threads;
+
+    for (int t = 0; t < num_threads; ++t) {
+        workers[t].queries = queries;
+        workers[t].begin = min(t * chunk, num_queries);
+        workers[t].end = min(workers[t].begin + chunk, num_queries);
+
+        pthread_create(&workers[t].thread, NULL, query_worker, &workers[t]);
+    }
+
+    for (int t = 0; t < num_threads; ++t)
+        pthread_join(workers[t].thread, NULL);
+}
+
+int compare_intervals(const void* a, const void* b)
+{
+    const struct interval* ia = a;
+    const struct interval* ib = b;
+
+    return ia->low - ib->low;
+}
+
+void sort_intervals(struct interval* intervals, int n)
+{
+    qsort(intervals, n, sizeof(struct interval), compare_intervals);
+}
+
+// The stored intervals in sorted order, to join the tree against another set
+int gather_intervals(struct interval* intervals)
+{
+    i16 *sorted = malloc(N * sizeof(i16));
+    i16 slen = 0;
+
+    gather_sorted(root, sorted, &slen);
+
+    for (i16 i = 0; i < slen; ++i) {
+        intervals[i].low = nodes[sorted[i]].low;
+        intervals[i].high = nodes[sorted[i]].high;
+    }
+
+    free(sorted);
+
+    return slen;
+}
+
+// Removes the active intervals that end before low and pairs the rest with
+// the interval that has just started at low
+int sweep_active(struct interval* set, int* active, int alen, i16 low, int cur,
+        bool cur_is_a, void (*emit)(int a, int b, void* ctx), void* ctx)
+{
+    int kept = 0;
+
+    for (int i = 0; i < alen; ++i) {
+        if (set[active[i]].high < low)
+            continue;
+
+        active[kept++] = active[i];
+
+        if (cur_is_a)
+            emit(cur, active[i], ctx);
+        else
+            emit(active[i], cur, ctx);
+    }
+
+    return kept;
+}
+
+// Reports every overlapping pair between two sets sorted by low, as indices
+// into `a` and `b`. A merge sweep visits intervals by increasing low, and
+// every pair is found when its later-starting member is visited, against
+// the other set's intervals that are still open. O(n + m + k)
+void join_overlapping(struct interval* a, int n, struct interval* b, int m,
+        void (*emit)(int a, int b, void* ctx), void* ctx)
+{
+    int *active_a = malloc(n * sizeof(int));
+    int *active_b = malloc(m * sizeof(int));
+    int alen = 0;
+    int blen = 0;
+    int i = 0;
+    int j = 0;
+
+    while (i < n || j < m) {
+        if (j == m || (i < n && a[i].low <= b[j].low)) {
+            blen = sweep_active(b, active_b, blen, a[i].low, i, true, emit, ctx);
+            active_a[alen++] = i++;
+        } else {
+            alen = sweep_active(a, active_a, alen, b[j].low, j, false, emit, ctx);
+            active_b[blen++] = j++;
+        }
+    }
+
+    free(active_a);
+    free(active_b);
+}
+
 void printer(i16 x, int level)
 {
     if (x == T)
@@ -336,11 +826,32 @@ void check_max(i16 x)
         check_max(nodes[x].right);
 }
 
+i16 calc_size(i16 x)
+{
+    if (x == T)
+        return 0;
+
+    return 1 + calc_size(nodes[x].left) + calc_size(nodes[x].right);
+}
+
+void check_size(i16 x)
+{
+    assert(calc_size(x) == nodes[x].size);
+
+    if (nodes[x].left != T)
+        check_size(nodes[x].left);
+
+    if (nodes[x].right != T)
+        check_size(nodes[x].right);
+}
+
 void check_invariants()
 {
     check_inequality(root);
     check_height(root);
     check_max(root);
+    check_size(root);
+    assert(ep_size(high_root) == len);
 }
 
 void find_all_overlapping_naive(i16 low, i16 high, i16* actual, i16* alen)
@@ -367,6 +878,26 @@ void check_overlaps(i16 *results, i16 rlen, i16 *actual, i16 alen)
     }
 }
 
+void check_extremes(i16 low, i16 high, i16 *actual, i16 alen)
+{
+    i16 leftmost = search_leftmost(low, high);
+    i16 rightmost = search_rightmost(low, high);
+
+    if (alen == 0) {
+        assert(leftmost == T && rightmost == T);
+        return;
+    }
+
+    assert(leftmost != T && rightmost != T);
+    assert(overlap(low, high, nodes[leftmost].low, nodes[leftmost].high));
+    assert(overlap(low, high, nodes[rightmost].low, nodes[rightmost].high));
+
+    for (i16 i = 0; i < alen; ++i) {
+        assert(nodes[actual[i]].low >= nodes[leftmost].low);
+        assert(nodes[actual[i]].low <= nodes[rightmost].low);
+    }
+}
+
 void test_overlaps()
 {
     i16 x = root;
@@ -387,12 +918,140 @@ void test_overlaps()
             find_all_overlapping_naive(i, j, actual, &alen);
 
             check_overlaps(results, rlen, actual, alen);
+            assert(count_overlapping(i, j) == alen);
+            check_extremes(i, j, actual, alen);
 
             free(results);
             free(actual);
         }
 }
 
+void test_overlaps_batch()
+{
+    i16 x = root;
+    while (nodes[x].left != T)
+        x = nodes[x].left;
+
+    i16 start = nodes[x].low;
+    i16 end = nodes[root].max;
+
+    int num_queries = 2000;
+    struct query *queries = malloc(num_queries * sizeof(struct query));
+    int total = 0;
+
+    for (int q = 0; q < num_queries; ++q) {
+        i16 low = start + rand() % (end - start + 1);
+        i16 high = low + rand() % (end - low + 1);
+
+        queries[q].low = low;
+        queries[q].high = high;
+
+        total += count_overlapping(low, high);
+    }
+
+    i16 *results = malloc(total * sizeof(i16));
+    i16 *actual = malloc(N * sizeof(i16));
+
+    find_all_overlapping_batch(queries, num_queries, results);
+
+    for (int q = 0; q < num_queries; ++q) {
+        i16 alen = 0;
+
+        find_all_overlapping_naive(queries[q].low, queries[q].high, actual, &alen);
+
+        check_overlaps(results + queries[q].first, queries[q].count, actual, alen);
+    }
+
+    free(queries);
+    free(results);
+    free(actual);
+}
+
+void test_overlaps_parallel()
+{
+    int num_queries = 2000;
+    int num_threads = 4;
+    struct query *queries = malloc(num_queries * sizeof(struct query));
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    i16 *actual = malloc(N * sizeof(i16));
+
+    for (int q = 0; q < num_queries; ++q) {
+        queries[q].low = rand() % 400;
+        queries[q].high = queries[q].low + rand() % 100;
+    }
+
+    find_all_overlapping_parallel(queries, num_queries, workers, num_threads);
+
+    for (int t = 0; t < num_threads; ++t) {
+        for (int q = workers[t].begin; q < workers[t].end; ++q) {
+            i16 alen = 0;
+
+            find_all_overlapping_naive(queries[q].low, queries[q].high, actual, &alen);
+
+            check_overlaps(workers[t].results + queries[q].first, queries[q].count,
+                    actual, alen);
+        }
+
+        free(workers[t].results);
+    }
+
+    free(queries);
+    free(workers);
+    free(actual);
+}
+
+struct join_check {
+    uint8_t* seen;
+    int m;
+    int pairs;
+};
+
+void record_pair(int a, int b, void* ctx)
+{
+    struct join_check* check = ctx;
+
+    assert(check->seen[a * check->m + b] == 0);
+
+    check->seen[a * check->m + b] = 1;
+    check->pairs++;
+}
+
+void test_join()
+{
+    struct interval *a = malloc(N * sizeof(struct interval));
+    int n = gather_intervals(a);
+
+    int m = 100 + rand() % 300;
+    struct interval *b = malloc(m * sizeof(struct interval));
+
+    for (int j = 0; j < m; ++j) {
+        b[j].low = 1 + rand() % 400;
+        b[j].high = b[j].low + rand() % 50;
+    }
+
+    sort_intervals(b, m);
+
+    struct join_check check = { calloc(n * m, 1), m, 0 };
+
+    join_overlapping(a, n, b, m, record_pair, &check);
+
+    int expected = 0;
+
+    for (int i = 0; i < n; ++i)
+        for (int j = 0; j < m; ++j) {
+            bool o = overlap(a[i].low, a[i].high, b[j].low, b[j].high);
+
+            assert(o == check.seen[i * m + j]);
+            expected += o;
+        }
+
+    assert(check.pairs == expected);
+
+    free(check.seen);
+    free(a);
+    free(b);
+}
+
 void test()
 {
     int num_tests = 0;
@@ -405,6 +1064,7 @@ void test()
         srand(num_tests);
 
         root = T;
+        high_root = T;
         len = 0;
 
         int num_intervals = 300 + rand() % 300;
@@ -418,11 +1078,96 @@ void test()
 
         check_invariants();
 
+#ifdef STATS
+        stats_dump("avl_tree_ref", &stats);
+        stats_reset(&stats);
+#endif
+
         test_overlaps();
+        test_overlaps_batch();
+        test_overlaps_parallel();
+        test_join();
     }
 }
 
-int main()
+double now()
 {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Doubles the thread count, but ends on max_threads itself when it isn't a
+// power of two
+int next_threads(int threads, int max_threads)
+{
+    if (threads < max_threads && threads * 2 > max_threads)
+        return max_threads;
+
+    return threads * 2;
+}
+
+void bench_parallel(int max_threads)
+{
+    srand(1);
+
+    root = T;
+    high_root = T;
+    len = 0;
+
+    for (int i = 0; i < N; ++i) {
+        int low = rand() % 4000;
+        int high = low + rand() % 40;
+
+        insert(low, high);
+    }
+
+    int num_queries = 1000000;
+    struct query *queries = malloc(num_queries * sizeof(struct query));
+    struct worker *workers = calloc(max_threads, sizeof(struct worker));
+
+    for (int q = 0; q < num_queries; ++q) {
+        queries[q].low = rand() % 4000;
+        queries[q].high = queries[q].low + rand() % 40;
+    }
+
+    double base = 0;
+
+    for (int threads = 1; threads <= max_threads; threads = next_threads(threads, max_threads)) {
+        double start = now();
+
+        find_all_overlapping_parallel(queries, num_queries, workers, threads);
+
+        double elapsed = now() - start;
+
+        if (threads == 1)
+            base = elapsed;
+
+        printf("threads=%d time=%.3fs queries/s=%.0f speedup=%.2f\n", threads, elapsed,
+                num_queries / elapsed, base / elapsed);
+    }
+
+    for (int t = 0; t < max_threads; ++t)
+        free(workers[t].results);
+
+    free(queries);
+    free(workers);
+}
+
+#ifndef NO_MAIN
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+        bench_parallel(max_threads);
+        return 0;
+    }
+
     test();
 }
+
+#endif
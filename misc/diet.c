@@ -13,7 +13,9 @@
 #define max(a, b) ((a) > (b) ? (a) : (b))
 
 #define i16 int16_t
+#ifndef N
 #define N 10000
+#endif
 #define T INT16_MAX
 
 #define TEST_MAX_VAL 26
@@ -23,6 +25,8 @@
 uint8_t mask[MASK_LEN];
 uint8_t test_mask[MASK_LEN];
 
+void blit(i16 start, i16 end);
+
 struct node
 {
     i16 low;
@@ -35,12 +39,6 @@ i16 len = 0;
 i16 root = T;
 struct node nodes[N];
 
-void blit(i16 start, i16 end)
-{
-    for (i16 i = start; i <= end; ++i)
-        mask[i] = 2;
-}
-
 void insert_test_mask(i16 low, i16 high)
 {
     for (i16 i = low; i <= high; ++i)
@@ -365,6 +363,14 @@ void check_isolation()
             assert(!overlapping_or_adjacent(values[x], values[y]));
 }
 
+#ifndef NO_MAIN
+
+void blit(i16 start, i16 end)
+{
+    for (i16 i = start; i <= end; ++i)
+        mask[i] = 2;
+}
+
 void test()
 {
     int test_num = 0;
@@ -498,3 +504,5 @@ int main()
 
     test();
 }
+
+#endif
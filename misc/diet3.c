@@ -8,6 +8,10 @@
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "stats.h"
 
 #define i16 int16_t
 #define max(a, b) ((a) > (b) ? (a) : (b))
@@ -32,12 +36,64 @@ struct node {
 
 const i16 bal_const = 1;
 
-#define N 1000
+// Only a cap, see nodes
+#ifndef N
+#define N (INT16_MAX - 1)
+#endif
 #define T INT16_MAX
 
-i16 len = 0;
-i16 root = T;
-struct node nodes[N];
+// Lets a multi-threaded includer give every thread its own tree
+#ifndef DIET_TLS
+#define DIET_TLS
+#endif
+
+DIET_TLS i16 len = 0;
+DIET_TLS i16 root = T;
+// Room for N nodes is reserved up front and the pages are committed as the
+// tree first touches them, so the pool follows the workload and indices
+// never move. Chunks that grow on demand cost an extra dependent load per
+// node visited, 40-50% on replays
+DIET_TLS struct node* nodes;
+
+#ifdef STATS
+DIET_TLS struct stats stats;
+#endif
+
+// Inserts never modify existing nodes, so any old root is still a valid
+// tree. A checkpoint keeps one alive; T is a valid (empty) root, hence the
+// separate flag
+#define MAX_CHECKPOINTS 16
+DIET_TLS i16 checkpoints[MAX_CHECKPOINTS];
+DIET_TLS bool checkpoint_used[MAX_CHECKPOINTS];
+
+// Bounded mode (insert_bounded), for columns that would otherwise exhaust
+// the pool, like a fence seen edge-on. The pixels of the gaps it fills in
+// and of the spans it has to drop are never blitted, lost_pixels counts
+// them
+DIET_TLS i16 node_budget = N;
+DIET_TLS long lost_pixels = 0;
+
+// Gives the pool back, e.g. when a thread is done with its tree
+void diet_free()
+{
+    if (nodes)
+        munmap(nodes, N * sizeof(struct node));
+
+    nodes = NULL;
+    len = 0;
+    root = T;
+    memset(checkpoint_used, 0, sizeof(checkpoint_used));
+}
+
+void blit_run(i16 start, i16 end)
+{
+    if (start > end)
+        return;
+
+    STAT(stat_blit(&stats, start, end));
+
+    blit(start, end);
+}
 
 i16 height(i16 tree)
 {
@@ -58,8 +114,20 @@ i16 new_node(i16 start, i16 end, i16 height, i16 left, i16 right)
 
     assert(n < N);
 
+    if (!nodes) {
+        nodes = mmap(NULL, N * sizeof(struct node), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+        if (nodes == MAP_FAILED)
+            err(1, "mmap");
+    }
+
+#ifdef VERBOSE
     printf("create_node(start=%d end=%d height=%d left=%d right=%d) = %d\n",
             start, end, height, left, right, n);
+#endif
+
+    STAT(stats.nodes++);
 
     len += 1;
 
@@ -91,6 +159,8 @@ i16 balance(i16 start, i16 end, i16 l, i16 r)
         i16 ll = nodes[l].left;
         i16 lr = nodes[l].right;
 
+        STAT(stats.rotations++);
+
         if (height(ll) >= height(lr)) {
             return create(ls, le, ll, create(start, end, lr, r));
         } else {
@@ -118,6 +188,8 @@ i16 balance(i16 start, i16 end, i16 l, i16 r)
         i16 rl = nodes[r].left;
         i16 rr = nodes[r].right;
 
+        STAT(stats.rotations++);
+
         if (height(rr) >= height(rl)) {
             return create(rs, re, create(start, end, l, rl), rr);
         } else {
@@ -197,12 +269,27 @@ i16 join(i16 start, i16 end, i16 l, i16 r)
         return create(start, end, l, r);
 }
 
-void find_del_left(i16 tree, i16 start, i16 def_blit_end, i16* outs, i16* outl)
+// Blits the gaps between the intervals of a subtree that is being absorbed,
+// in order, starting from *blit_start
+void blit_gaps(i16 tree, i16* blit_start)
+{
+    if (tree == T)
+        return;
+
+    blit_gaps(nodes[tree].left, blit_start);
+    blit_run(*blit_start, nodes[tree].start - 1);
+    *blit_start = nodes[tree].end + 1;
+    blit_gaps(nodes[tree].right, blit_start);
+}
+
+void find_del_left(i16 tree, i16 start, i16 blit_end, i16* outs, i16* outl)
 {
+    STAT_FRAME(stats);
+
     if (tree == T) {
         *outs = start;
         *outl = T;
-        blit(start, def_blit_end);
+        blit_run(start, blit_end);
         return;
     }
 
@@ -214,25 +301,33 @@ void find_del_left(i16 tree, i16 start, i16 def_blit_end, i16* outs, i16* outl)
     if (start > e + 1) {
         i16 news;
         i16 newr;
-        find_del_left(r, start, def_blit_end, &news, &newr);
+        find_del_left(r, start, blit_end, &news, &newr);
 
         *outs = news;
         *outl = join(s, e, l, newr);
-    } else if (start < s) {
-        find_del_left(l, start, def_blit_end, outs, outl);
     } else {
-        blit(e + 1, def_blit_end);
-        *outs = s;
-        *outl = l;
+        // The node and its right subtree are absorbed
+        i16 blit_start = e + 1;
+        blit_gaps(r, &blit_start);
+        blit_run(blit_start, blit_end);
+
+        if (start < s) {
+            find_del_left(l, start, s - 1, outs, outl);
+        } else {
+            *outs = s;
+            *outl = l;
+        }
     }
 }
 
-void find_del_right(i16 tree, i16 end, i16 def_blit_start, i16* oute, i16* outr)
+void find_del_right(i16 tree, i16 end, i16 blit_start, i16* oute, i16* outr)
 {
+    STAT_FRAME(stats);
+
     if (tree == T) {
         *oute = end;
         *outr = T;
-        blit(def_blit_start, end);
+        blit_run(blit_start, end);
         return;
     }
 
@@ -244,23 +339,30 @@ void find_del_right(i16 tree, i16 end, i16 def_blit_start, i16* oute, i16* outr)
     if (end < s - 1) {
         i16 newe;
         i16 newl;
-        find_del_right(l, end, def_blit_start, &newe, &newl);
+        find_del_right(l, end, blit_start, &newe, &newl);
 
         *oute = newe;
         *outr = join(s, e, newl, r);
-    } else if (end > e) {
-        find_del_right(r, end, def_blit_start, oute, outr);
     } else {
-        blit(def_blit_start, s - 1);
-        *oute = e;
-        *outr = r;
+        // The node and its left subtree are absorbed
+        blit_gaps(l, &blit_start);
+        blit_run(blit_start, s - 1);
+
+        if (end > e) {
+            find_del_right(r, end, e + 1, oute, outr);
+        } else {
+            *oute = e;
+            *outr = r;
+        }
     }
 }
 
 i16 insert_range(i16 tree, i16 start, i16 end)
 {
+    STAT_FRAME(stats);
+
     if (tree == T) {
-        blit(start, end);
+        blit_run(start, end);
         return new_node(start, end, 1, T, T);
     }
 
@@ -303,9 +405,428 @@ void insert(i16 start, i16 end)
 {
     root = insert_range(root, start, end);
 
+    STAT(stat_insert_done(&stats));
+
     debug_insert(start, end);
 }
 
+// Everything in the tree below x, cutting the interval that contains x
+i16 split_lt(i16 tree, i16 x)
+{
+    if (tree == T)
+        return T;
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    if (x <= s)
+        return split_lt(l, x);
+    else if (x > e)
+        return join(s, e, l, split_lt(r, x));
+    else
+        return add(l, false, s, x - 1);
+}
+
+// Everything in the tree above x, cutting the interval that contains x
+i16 split_gt(i16 tree, i16 x)
+{
+    if (tree == T)
+        return T;
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    if (x >= e)
+        return split_gt(r, x);
+    else if (x < s)
+        return join(s, e, split_gt(l, x), r);
+    else
+        return add(r, true, x + 1, e);
+}
+
+i16 remove_min(i16 tree, i16* outs, i16* oute)
+{
+    i16 l = nodes[tree].left;
+
+    if (l == T) {
+        *outs = nodes[tree].start;
+        *oute = nodes[tree].end;
+        return nodes[tree].right;
+    }
+
+    return balance(nodes[tree].start, nodes[tree].end, remove_min(l, outs, oute),
+            nodes[tree].right);
+}
+
+i16 remove_max(i16 tree, i16* outs, i16* oute)
+{
+    i16 r = nodes[tree].right;
+
+    if (r == T) {
+        *outs = nodes[tree].start;
+        *oute = nodes[tree].end;
+        return nodes[tree].left;
+    }
+
+    return balance(nodes[tree].start, nodes[tree].end, nodes[tree].left,
+            remove_max(r, outs, oute));
+}
+
+// Joins two trees where everything in l is below everything in r, with at
+// least one uncovered value in between
+i16 concat(i16 l, i16 r)
+{
+    if (l == T)
+        return r;
+
+    if (r == T)
+        return l;
+
+    i16 s, e;
+    i16 newr = remove_min(r, &s, &e);
+
+    return join(s, e, l, newr);
+}
+
+// Like join, but l and r may end and start right next to [start, end]
+i16 join_adjacent(i16 start, i16 end, i16 l, i16 r)
+{
+    i16 s, e;
+
+    if (l != T) {
+        i16 m = l;
+        while (nodes[m].right != T)
+            m = nodes[m].right;
+
+        if (nodes[m].end + 1 == start) {
+            l = remove_max(l, &s, &e);
+            start = s;
+        }
+    }
+
+    if (r != T) {
+        i16 m = r;
+        while (nodes[m].left != T)
+            m = nodes[m].left;
+
+        if (nodes[m].start - 1 == end) {
+            r = remove_min(r, &s, &e);
+            end = e;
+        }
+    }
+
+    return join(start, end, l, r);
+}
+
+// The set operations split a around the root interval of b and recurse on
+// both sides, so the work follows the smaller tree: O(m log(n/m + 1))
+i16 diet_union(i16 a, i16 b)
+{
+    if (a == T)
+        return b;
+
+    if (b == T)
+        return a;
+
+    i16 s = nodes[b].start;
+    i16 e = nodes[b].end;
+
+    i16 l = diet_union(split_lt(a, s), nodes[b].left);
+    i16 r = diet_union(split_gt(a, e), nodes[b].right);
+
+    return join_adjacent(s, e, l, r);
+}
+
+i16 diet_inter(i16 a, i16 b)
+{
+    if (a == T || b == T)
+        return T;
+
+    i16 s = nodes[b].start;
+    i16 e = nodes[b].end;
+
+    i16 l = diet_inter(split_lt(a, s), nodes[b].left);
+    i16 m = split_gt(split_lt(a, e + 1), s - 1);
+    i16 r = diet_inter(split_gt(a, e), nodes[b].right);
+
+    return concat(concat(l, m), r);
+}
+
+i16 diet_diff(i16 a, i16 b)
+{
+    if (a == T || b == T)
+        return a;
+
+    i16 s = nodes[b].start;
+    i16 e = nodes[b].end;
+
+    i16 l = diet_diff(split_lt(a, s), nodes[b].left);
+    i16 r = diet_diff(split_gt(a, e), nodes[b].right);
+
+    return concat(l, r);
+}
+
+int diet_checkpoint()
+{
+    for (int h = 0; h < MAX_CHECKPOINTS; ++h)
+        if (!checkpoint_used[h]) {
+            checkpoint_used[h] = true;
+            checkpoints[h] = root;
+            return h;
+        }
+
+    err(1, "diet_checkpoint: out of checkpoints");
+}
+
+void diet_restore(int h)
+{
+    assert(checkpoint_used[h]);
+
+    root = checkpoints[h];
+}
+
+void diet_release(int h)
+{
+    checkpoint_used[h] = false;
+}
+
+void mark(i16 tree, bool* marked)
+{
+    while (tree != T && !marked[tree]) {
+        marked[tree] = true;
+        mark(nodes[tree].left, marked);
+        tree = nodes[tree].right;
+    }
+}
+
+// Reclaims the nodes unreachable from the root and the live checkpoints.
+// Live nodes only ever slide down, so copying them in index order never
+// overwrites a node that is yet to move. Their new indices are all known
+// before the copy, so it doesn't rely on children coming before parents
+void diet_gc()
+{
+    bool* marked = calloc(len, sizeof(bool));
+    i16* forward = malloc(len * sizeof(i16));
+
+    mark(root, marked);
+
+    for (int h = 0; h < MAX_CHECKPOINTS; ++h)
+        if (checkpoint_used[h])
+            mark(checkpoints[h], marked);
+
+    i16 live = 0;
+
+    for (i16 i = 0; i < len; ++i)
+        if (marked[i])
+            forward[i] = live++;
+
+    for (i16 i = 0; i < len; ++i) {
+        if (!marked[i])
+            continue;
+
+        i16 l = nodes[i].left;
+        i16 r = nodes[i].right;
+        i16 x = forward[i];
+
+        nodes[x] = nodes[i];
+        nodes[x].left = l == T ? T : forward[l];
+        nodes[x].right = r == T ? T : forward[r];
+    }
+
+    len = live;
+
+    if (root != T)
+        root = forward[root];
+
+    for (int h = 0; h < MAX_CHECKPOINTS; ++h)
+        if (checkpoint_used[h] && checkpoints[h] != T)
+            checkpoints[h] = forward[checkpoints[h]];
+
+    free(marked);
+    free(forward);
+}
+
+bool diet_overlaps(i16 tree, i16 start, i16 end)
+{
+    while (tree != T) {
+        if (end < nodes[tree].start)
+            tree = nodes[tree].left;
+        else if (start > nodes[tree].end)
+            tree = nodes[tree].right;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+struct gap {
+    i16 width;
+    i16 index;
+};
+
+int compare_gaps(const void* a, const void* b)
+{
+    const struct gap* x = a;
+    const struct gap* y = b;
+
+    if (x->width != y->width)
+        return x->width - y->width;
+
+    return x->index - y->index;
+}
+
+void gather_runs(i16 tree, i16* starts, i16* ends, int* num)
+{
+    if (tree == T)
+        return;
+
+    gather_runs(nodes[tree].left, starts, ends, num);
+    starts[*num] = nodes[tree].start;
+    ends[*num] = nodes[tree].end;
+    (*num)++;
+    gather_runs(nodes[tree].right, starts, ends, num);
+}
+
+i16 build_balanced(i16* starts, i16* ends, int lo, int hi)
+{
+    if (lo >= hi)
+        return T;
+
+    int mid = lo + (hi - lo) / 2;
+
+    i16 l = build_balanced(starts, ends, lo, mid);
+    i16 r = build_balanced(starts, ends, mid + 1, hi);
+
+    return create(starts[mid], ends[mid], l, r);
+}
+
+// Fills in the narrowest gaps of the root, as if covered, until it holds
+// at most target intervals. The runs are gathered first and the old tree is
+// swept before the new one is built, so the pool never holds both and ends
+// up with the checkpoints' nodes and target more at most
+void coarsen(int target)
+{
+    i16* starts = malloc(len * sizeof(i16));
+    i16* ends = malloc(len * sizeof(i16));
+    struct gap* gaps = malloc(len * sizeof(struct gap));
+    bool* filled = malloc(len * sizeof(bool));
+
+    int num = 0;
+
+    gather_runs(root, starts, ends, &num);
+
+    if (num <= target) {
+        free(starts);
+        free(ends);
+        free(gaps);
+        free(filled);
+        return;
+    }
+
+    for (int i = 0; i + 1 < num; ++i) {
+        gaps[i] = (struct gap){ starts[i + 1] - ends[i] - 1, i };
+        filled[i] = false;
+    }
+
+    qsort(gaps, num - 1, sizeof(struct gap), compare_gaps);
+
+    for (int g = 0; g < num - target; ++g) {
+        filled[gaps[g].index] = true;
+        lost_pixels += gaps[g].width;
+    }
+
+    int merged = 0;
+
+    for (int i = 0; i < num; ++i) {
+        if (i > 0 && filled[i - 1]) {
+            ends[merged - 1] = ends[i];
+        } else {
+            starts[merged] = starts[i];
+            ends[merged] = ends[i];
+            merged++;
+        }
+    }
+
+    root = T;
+    diet_gc();
+    root = build_balanced(starts, ends, 0, merged);
+
+    free(starts);
+    free(ends);
+    free(gaps);
+    free(filled);
+}
+
+// Nodes one insert_range may allocate. It copies one node per level on the
+// way down to the node the span lands on, and below that one per level on
+// each of find_del_left and find_del_right, so at most 2 per level. On top
+// of that come the joins on the way up: a double rotation is 2 more nodes,
+// and joining uneven subtrees copies a level or two of the taller one. 4
+// covers both, test_reserve checks it on trees taller than the tests'
+i16 insert_reserve()
+{
+    return 2 * (height(root) + 1) + 4;
+}
+
+// Nodes the live checkpoints keep alive. After a coarsen they no longer
+// share any with the root, so they come on top of it
+i16 pinned_nodes()
+{
+    bool* marked = calloc(len, sizeof(bool));
+    i16 pinned = 0;
+
+    for (int h = 0; h < MAX_CHECKPOINTS; ++h)
+        if (checkpoint_used[h])
+            mark(checkpoints[h], marked);
+
+    for (i16 i = 0; i < len; ++i)
+        pinned += marked[i];
+
+    free(marked);
+
+    return pinned;
+}
+
+// Like insert, but memory and time per column stay bounded. When the pool
+// nears node_budget it's swept, and if that doesn't leave room for the
+// insert, the tree is coarsened to 3/4 of what the budget leaves next to
+// the checkpoints, halving that until the insert fits. If the checkpoints
+// alone leave no room, the span is dropped, its pixels are counted lost
+// and false is returned
+bool insert_bounded(i16 start, i16 end)
+{
+    assert(node_budget <= N);
+
+    if (len + insert_reserve() > node_budget) {
+        diet_gc();
+
+        int target = node_budget - insert_reserve() - pinned_nodes();
+
+        target -= target / 4;
+
+        while (len + insert_reserve() > node_budget && target > 0) {
+            coarsen(target);
+            target /= 2;
+        }
+
+        if (len + insert_reserve() > node_budget) {
+            lost_pixels += end - start + 1;
+            return false;
+        }
+    }
+
+    root = insert_range(root, start, end);
+
+    STAT(stat_insert_done(&stats));
+
+    return true;
+}
+
 void printer(i16 x, int level, int dir)
 {
     if (x == T)
@@ -421,6 +942,8 @@ void check_height(i16 x)
         check_height(nodes[x].right);
 }
 
+#ifndef NO_MAIN
+
 void print_mask(uint8_t* mask)
 {
     for (int i = 0; i < MASK_LEN; ++i)
@@ -472,10 +995,26 @@ void run_checks()
     check_masks();
 }
 
+// Dumps what the inserts since the last clear() counted, and starts over.
+// The set algebra and gc tests build their trees with insert_range()
+// directly, with no insert to charge the nodes to, so those are dropped
+void flush_stats()
+{
+#ifdef STATS
+    if (stats.inserts > 0)
+        stats_dump("diet3", &stats);
+
+    stats_reset(&stats);
+#endif
+}
+
 void clear()
 {
+    flush_stats();
+
     root = T;
     len = 0;
+    memset(checkpoint_used, 0, sizeof(checkpoint_used));
     memset(mask, 0, MASK_LEN);
     memset(test_mask, 0, MASK_LEN);
 
@@ -485,8 +1024,14 @@ void clear()
     printf("\n# test case %d\n", test_case++);
 }
 
+// The benchmark's spans don't fit the masks
+bool benchmarking = false;
+
 void blit(i16 start, i16 end)
 {
+    if (benchmarking)
+        return;
+
     for (i16 i = start; i <= end; ++i)
         mask[i] = 2;
 }
@@ -509,6 +1054,423 @@ void freeze_masks()
     }
 }
 
+void test_checkpoints()
+{
+    uint8_t saved_mask[MASK_LEN];
+    uint8_t saved_test_mask[MASK_LEN];
+
+    clear();
+    insert(2, 4);
+    insert(10, 12);
+    insert(20, 22);
+
+    int h = diet_checkpoint();
+    memcpy(saved_mask, mask, MASK_LEN);
+    memcpy(saved_test_mask, test_mask, MASK_LEN);
+
+    insert(5, 9);
+    insert(15, 25);
+    insert(1, 30);
+
+    // Roll back and take a different path from the same state
+    diet_restore(h);
+    memcpy(mask, saved_mask, MASK_LEN);
+    memcpy(test_mask, saved_test_mask, MASK_LEN);
+    run_checks();
+
+    insert(6, 8);
+    insert(13, 14);
+
+    int h2 = diet_checkpoint();
+    memcpy(saved_mask, mask, MASK_LEN);
+    memcpy(saved_test_mask, test_mask, MASK_LEN);
+
+    insert(3, 27);
+
+    // h is released, so gc drops the nodes only it pinned. Only h2 survives,
+    // next to the live tree
+    i16 before = len;
+    diet_release(h);
+    diet_gc();
+    assert(len < before);
+    run_checks();
+
+    diet_restore(h2);
+    memcpy(mask, saved_mask, MASK_LEN);
+    memcpy(test_mask, saved_test_mask, MASK_LEN);
+    diet_gc();
+    run_checks();
+
+    insert(0, 30);
+}
+
+void fill_bits(i16 tree, uint8_t* bits)
+{
+    if (tree == T)
+        return;
+
+    for (i16 i = nodes[tree].start; i <= nodes[tree].end; ++i)
+        bits[i] = 1;
+
+    fill_bits(nodes[tree].left, bits);
+    fill_bits(nodes[tree].right, bits);
+}
+
+i16 random_set(uint8_t* bits)
+{
+    root = T;
+
+    int num_ranges = rand() % 6;
+
+    for (int i = 0; i < num_ranges; ++i) {
+        i16 start = rand() % START_RAND;
+        i16 end = start + rand() % SIZE_RAND;
+
+        root = insert_range(root, start, end);
+    }
+
+    memset(bits, 0, MASK_LEN);
+    fill_bits(root, bits);
+
+    return root;
+}
+
+void check_set(i16 tree, uint8_t* expected)
+{
+    uint8_t bits[MASK_LEN] = { 0 };
+
+    fill_bits(tree, bits);
+
+    assert(memcmp(bits, expected, MASK_LEN) == 0);
+
+    if (tree == T)
+        return;
+
+    root = tree;
+    check_inequality(root);
+    check_isolation();
+    check_height(root);
+}
+
+void test_set_algebra()
+{
+    uint8_t abits[MASK_LEN];
+    uint8_t bbits[MASK_LEN];
+    uint8_t expected[MASK_LEN];
+
+    clear();
+
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        len = 0;
+
+        i16 a = random_set(abits);
+        i16 b = random_set(bbits);
+
+        for (int i = 0; i < MASK_LEN; ++i)
+            expected[i] = abits[i] | bbits[i];
+        check_set(diet_union(a, b), expected);
+
+        for (int i = 0; i < MASK_LEN; ++i)
+            expected[i] = abits[i] & bbits[i];
+        check_set(diet_inter(a, b), expected);
+
+        for (int i = 0; i < MASK_LEN; ++i)
+            expected[i] = abits[i] & !bbits[i];
+        check_set(diet_diff(a, b), expected);
+    }
+}
+
+// diet_gc must keep the tree and a checkpoint it shares nodes with intact
+void test_gc()
+{
+    uint8_t bits[MASK_LEN];
+    uint8_t saved[MASK_LEN];
+
+    clear();
+
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        len = 0;
+
+        random_set(saved);
+        int h = diet_checkpoint();
+        random_set(bits);
+
+        // The random sets start over from an empty tree, add to the
+        // checkpoint instead so the two share nodes
+        root = checkpoints[h];
+
+        for (int i = 0; i < 4; ++i) {
+            i16 start = rand() % START_RAND;
+            i16 end = start + rand() % SIZE_RAND;
+
+            root = insert_range(root, start, end);
+        }
+
+        memset(bits, 0, MASK_LEN);
+        fill_bits(root, bits);
+
+        diet_gc();
+        check_set(root, bits);
+
+        root = insert_range(root, 0, 2);
+        fill_bits(root, bits);
+        diet_gc();
+        check_set(root, bits);
+
+        diet_restore(h);
+        check_set(root, saved);
+        diet_release(h);
+    }
+}
+
+int count_bits(uint8_t* bits)
+{
+    int count = 0;
+
+    for (int i = 0; i < MASK_LEN; ++i)
+        count += bits[i] != 0;
+
+    return count;
+}
+
+// A fence pattern under a small budget. The tree must cover everything
+// inserted, blit only inserted pixels, and the pixels it covers without
+// having blitted them must be exactly the ones reported lost
+void test_bounded()
+{
+    uint8_t inserted[MASK_LEN];
+    uint8_t bits[MASK_LEN];
+
+    clear();
+
+    node_budget = 20;
+
+    for (int test = 0; test < 100; ++test) {
+        srand(test);
+        root = T;
+        len = 0;
+        lost_pixels = 0;
+        memset(mask, 0, MASK_LEN);
+        memset(inserted, 0, MASK_LEN);
+
+        for (int op = 0; op < 60; ++op) {
+            i16 start = rand() % (MASK_LEN / 2) * 2;
+            i16 end = start + (rand() % 4 == 0 ? 2 : 0);
+
+            if (end > TEST_MAX_VAL)
+                end = TEST_MAX_VAL;
+
+            assert(insert_bounded(start, end));
+
+            for (i16 i = start; i <= end; ++i)
+                inserted[i] = 1;
+
+            memset(bits, 0, MASK_LEN);
+            fill_bits(root, bits);
+
+            for (int i = 0; i < MASK_LEN; ++i) {
+                assert(!inserted[i] || bits[i]);
+                assert(!mask[i] || inserted[i]);
+            }
+
+            assert(count_bits(bits) - count_bits(mask) == lost_pixels);
+            assert(len <= node_budget);
+
+            check_inequality(root);
+            check_isolation();
+            check_height(root);
+        }
+    }
+
+    printf("bounded: %ld pixels lost in the last case\n", lost_pixels);
+
+    // A checkpoint pins the start of a fence. Coarsening the rest makes room
+    // next to it until the budget shrinks below what it pins, then spans are
+    // dropped and their pixels lost
+    clear();
+
+    for (i16 i = 0; i < 8; i += 2)
+        root = insert_range(root, i, i);
+
+    int h = diet_checkpoint();
+
+    for (i16 i = 8; i < MASK_LEN; i += 2)
+        root = insert_range(root, i, i);
+
+    diet_gc();
+    memset(mask, 0, MASK_LEN);
+    lost_pixels = 0;
+    node_budget = 30;
+
+    assert(insert_bounded(1, 1));
+    assert(len <= node_budget && lost_pixels > 0);
+
+    long lost = lost_pixels;
+
+    node_budget = pinned_nodes() + 4;
+
+    assert(!insert_bounded(3, 5));
+    assert(lost_pixels == lost + 3);
+    assert(!mask[3] && !mask[4] && !mask[5]);
+
+    diet_release(h);
+
+    // A budget right at the pool's cap, with a checkpoint pinning half of
+    // it, so the root has to be coarsened next to it again and again. The
+    // old and the new tree must never be in the pool at once
+    benchmarking = true;
+    root = T;
+    len = 0;
+
+    for (int i = 0; i < INT16_MAX; i += 2) {
+        if (len > N / 2)
+            diet_gc();
+
+        root = insert_range(root, i, i);
+    }
+
+    h = diet_checkpoint();
+    root = T;
+    diet_gc();
+    lost_pixels = 0;
+    node_budget = N - 1;
+
+    for (int i = 0; i < INT16_MAX; i += 2) {
+        assert(insert_bounded(i, i));
+        assert(len <= node_budget);
+    }
+
+    assert(lost_pixels > 0);
+
+    diet_release(h);
+    benchmarking = false;
+
+    node_budget = N;
+}
+
+// Every insert_range must fit in the room insert_reserve() leaves for it,
+// over trees a lot taller than the tests' masks allow
+void test_reserve()
+{
+    benchmarking = true;
+
+    for (int test = 0; test < 200; ++test) {
+        srand(test);
+        root = T;
+        len = 0;
+
+        int range = 64 << (test % 9);
+
+        for (int op = 0; op < 2000; ++op) {
+            i16 start = rand() % range;
+            i16 end = start + (rand() % 8 == 0 ? rand() % (range / 8) : rand() % 3);
+
+            if (len > N / 2)
+                diet_gc();
+
+            i16 before = len;
+            i16 reserve = insert_reserve();
+
+            root = insert_range(root, start, end);
+
+            assert(len - before <= reserve);
+        }
+    }
+
+    benchmarking = false;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#define FLUSH_SIZE (16 << 20)
+#define COLD_BATCH 256
+
+// Cold lookups come in short batches after the tree was evicted by other
+// work, like a frame's blits, warm ones run back to back
+double time_lookups(i16* queries, int num_queries, bool cold)
+{
+    static uint8_t* flush;
+    int hits = 0;
+    double elapsed = 0;
+
+    if (!flush)
+        flush = malloc(FLUSH_SIZE);
+
+    for (int q = 0; q < num_queries; ) {
+        int batch = cold ? COLD_BATCH : num_queries;
+
+        if (cold)
+            memset(flush, q, FLUSH_SIZE);
+
+        double start = now();
+
+        for (int b = 0; b < batch && q < num_queries; ++b, ++q)
+            hits += diet_overlaps(root, queries[q], queries[q]);
+
+        elapsed += now() - start;
+    }
+
+    // Keeps the loop from being thrown away
+    if (hits < 0)
+        printf("%d\n", hits);
+
+    return elapsed * 1e9 / num_queries;
+}
+
+// A tree that went through many path-copying inserts without a sweep, so
+// the live nodes are scattered among the dead ones, looked up as it is and
+// after diet_gc packed them
+void bench_gc()
+{
+    int num_queries = 4000000;
+    i16* queries = malloc(num_queries * sizeof(i16));
+
+    benchmarking = true;
+    srand(1);
+    root = T;
+    len = 0;
+
+    while (len < N - 1000) {
+        i16 start = rand() % 30000;
+
+        root = insert_range(root, start, start + rand() % 8);
+    }
+
+    for (int q = 0; q < num_queries; ++q)
+        queries[q] = rand() % 30000;
+
+    i16 total = len;
+    const char* names[2] = { "fragmented", "diet_gc" };
+    double warm[2];
+    double cold[2];
+
+    for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1)
+            diet_gc();
+
+        warm[pass] = time_lookups(queries, num_queries, false);
+        cold[pass] = time_lookups(queries, num_queries / 100, true);
+    }
+
+    printf("nodes=%d live=%d height=%d\n", total, len, height(root));
+
+    for (int pass = 0; pass < 2; ++pass)
+        printf("%s: warm %.1f ns/lookup (%.2fx) cold %.1f ns/lookup (%.2fx)\n", names[pass],
+                warm[pass], warm[0] / warm[pass], cold[pass], cold[0] / cold[pass]);
+
+    benchmarking = false;
+    free(queries);
+}
+
 void debug_insert(i16 start, i16 end)
 {
     insert_test_mask(start, end);
@@ -518,8 +1480,13 @@ void debug_insert(i16 start, i16 end)
     printf("\n");
 }
 
-int main()
+int main(int argc, char** argv)
 {
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        bench_gc();
+        return 0;
+    }
+
     clear();
     insert(2, 5);
     insert(6, 8);
@@ -553,4 +1520,14 @@ int main()
     insert(14, 16);
     insert(13, 18);
     insert(2, 2);
+
+    test_checkpoints();
+    test_set_algebra();
+    test_bounded();
+    test_reserve();
+    test_gc();
+
+    flush_stats();
 }
+
+#endif
@@ -0,0 +1,760 @@
+// Interval map on the diet3 AVL machinery: every interval carries a small
+// value (a material or colour ID), touching intervals merge only when their
+// values match, and assigning over a range splits whatever it overlaps
+//
+// Like diet3 the tree is persistent, an update copies its path and leaves
+// the old root valid
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define i16 int16_t
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define TEST_MAX_VAL 30
+#define MASK_LEN (TEST_MAX_VAL + 1)
+#define TEST_VALUES 3
+
+// Value of the points no interval covers
+#define NONE -1
+
+struct node {
+    i16 start;
+    i16 end;
+    i16 value;
+    i16 height;
+    i16 left;
+    i16 right;
+};
+
+const i16 bal_const = 1;
+
+#ifndef N
+#define N 1000
+#endif
+#define T INT16_MAX
+
+i16 len = 0;
+i16 root = T;
+struct node nodes[N];
+
+i16 height(i16 tree)
+{
+    if (tree == T)
+        return 0;
+
+    return nodes[tree].height;
+}
+
+i16 height_join(i16 left, i16 right)
+{
+    return 1 + max(height(left), height(right));
+}
+
+i16 new_node(i16 start, i16 end, i16 value, i16 height, i16 left, i16 right)
+{
+    i16 n = len;
+
+    assert(n < N);
+
+    len += 1;
+
+    nodes[n].start = start;
+    nodes[n].end = end;
+    nodes[n].value = value;
+    nodes[n].height = height;
+    nodes[n].left = left;
+    nodes[n].right = right;
+
+    return n;
+}
+
+i16 create(i16 start, i16 end, i16 value, i16 l, i16 r)
+{
+    return new_node(start, end, value, height_join(l, r), l, r);
+}
+
+i16 balance(i16 start, i16 end, i16 value, i16 l, i16 r)
+{
+    i16 hl = height(l);
+    i16 hr = height(r);
+
+    if (hl > hr + bal_const) {
+        if (l == T)
+            err(0, "Node.balance");
+
+        i16 ls = nodes[l].start;
+        i16 le = nodes[l].end;
+        i16 lv = nodes[l].value;
+        i16 ll = nodes[l].left;
+        i16 lr = nodes[l].right;
+
+        if (height(ll) >= height(lr)) {
+            return create(ls, le, lv, ll, create(start, end, value, lr, r));
+        } else {
+            if (lr == T)
+                err(0, "Node.balance");
+
+            i16 lrs = nodes[lr].start;
+            i16 lre = nodes[lr].end;
+            i16 lrv = nodes[lr].value;
+            i16 lrl = nodes[lr].left;
+            i16 lrr = nodes[lr].right;
+
+            return create(
+                lrs,
+                lre,
+                lrv,
+                create(ls, le, lv, ll, lrl),
+                create(start, end, value, lrr, r)
+            );
+        }
+    } else if (hr > hl + bal_const) {
+        if (r == T)
+            err(0, "Node.balance");
+
+        i16 rs = nodes[r].start;
+        i16 re = nodes[r].end;
+        i16 rv = nodes[r].value;
+        i16 rl = nodes[r].left;
+        i16 rr = nodes[r].right;
+
+        if (height(rr) >= height(rl)) {
+            return create(rs, re, rv, create(start, end, value, l, rl), rr);
+        } else {
+            if (rl == T)
+                err(0, "Node.balance");
+
+            i16 rls = nodes[rl].start;
+            i16 rle = nodes[rl].end;
+            i16 rlv = nodes[rl].value;
+            i16 rll = nodes[rl].left;
+            i16 rlr = nodes[rl].right;
+
+            return create(
+                rls,
+                rle,
+                rlv,
+                create(start, end, value, l, rll),
+                create(rs, re, rv, rlr, rr)
+            );
+        }
+    } else {
+        i16 h = (hl >= hr) ? hl + 1 : hr + 1;
+        return new_node(start, end, value, h, l, r);
+    }
+}
+
+i16 add(i16 tree, bool left, i16 start, i16 end, i16 value)
+{
+    if (tree == T)
+        return new_node(start, end, value, 1, T, T);
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+    i16 v = nodes[tree].value;
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    if (left)
+        return balance(s, e, v, add(l, left, start, end, value), r);
+    else
+        return balance(s, e, v, l, add(r, left, start, end, value));
+}
+
+i16 join(i16 start, i16 end, i16 value, i16 l, i16 r)
+{
+    if (l == T)
+        return add(r, true, start, end, value);
+
+    if (r == T)
+        return add(l, false, start, end, value);
+
+    i16 ls = nodes[l].start;
+    i16 le = nodes[l].end;
+    i16 lv = nodes[l].value;
+    i16 lh = nodes[l].height;
+    i16 ll = nodes[l].left;
+    i16 lr = nodes[l].right;
+
+    i16 rs = nodes[r].start;
+    i16 re = nodes[r].end;
+    i16 rv = nodes[r].value;
+    i16 rh = nodes[r].height;
+    i16 rl = nodes[r].left;
+    i16 rr = nodes[r].right;
+
+    if (lh > rh + bal_const)
+        return balance(ls, le, lv, ll, join(start, end, value, lr, r));
+    else if (rh > lh + bal_const)
+        return balance(rs, re, rv, join(start, end, value, l, rl), rr);
+    else
+        return create(start, end, value, l, r);
+}
+
+// Everything in the tree below x, cutting the interval that contains x
+i16 split_lt(i16 tree, i16 x)
+{
+    if (tree == T)
+        return T;
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+    i16 v = nodes[tree].value;
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    if (x <= s)
+        return split_lt(l, x);
+    else if (x > e)
+        return join(s, e, v, l, split_lt(r, x));
+    else
+        return add(l, false, s, x - 1, v);
+}
+
+// Everything in the tree above x, cutting the interval that contains x
+i16 split_gt(i16 tree, i16 x)
+{
+    if (tree == T)
+        return T;
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+    i16 v = nodes[tree].value;
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    if (x >= e)
+        return split_gt(r, x);
+    else if (x < s)
+        return join(s, e, v, split_gt(l, x), r);
+    else
+        return add(r, true, x + 1, e, v);
+}
+
+i16 remove_min(i16 tree, i16* outs, i16* oute, i16* outv)
+{
+    i16 l = nodes[tree].left;
+
+    if (l == T) {
+        *outs = nodes[tree].start;
+        *oute = nodes[tree].end;
+        *outv = nodes[tree].value;
+        return nodes[tree].right;
+    }
+
+    return balance(nodes[tree].start, nodes[tree].end, nodes[tree].value,
+            remove_min(l, outs, oute, outv), nodes[tree].right);
+}
+
+i16 remove_max(i16 tree, i16* outs, i16* oute, i16* outv)
+{
+    i16 r = nodes[tree].right;
+
+    if (r == T) {
+        *outs = nodes[tree].start;
+        *oute = nodes[tree].end;
+        *outv = nodes[tree].value;
+        return nodes[tree].left;
+    }
+
+    return balance(nodes[tree].start, nodes[tree].end, nodes[tree].value,
+            nodes[tree].left, remove_max(r, outs, oute, outv));
+}
+
+// Joins two trees where everything in l is below everything in r
+i16 concat(i16 l, i16 r)
+{
+    if (l == T)
+        return r;
+
+    if (r == T)
+        return l;
+
+    i16 s, e, v;
+    i16 newr = remove_min(r, &s, &e, &v);
+
+    return join(s, e, v, l, newr);
+}
+
+// Like join, but absorbs the last interval of l and the first of r when
+// they touch [start, end] and carry the same value
+i16 join_equal(i16 start, i16 end, i16 value, i16 l, i16 r)
+{
+    i16 s, e, v;
+
+    if (l != T) {
+        i16 m = l;
+        while (nodes[m].right != T)
+            m = nodes[m].right;
+
+        if (nodes[m].end + 1 == start && nodes[m].value == value) {
+            l = remove_max(l, &s, &e, &v);
+            start = s;
+        }
+    }
+
+    if (r != T) {
+        i16 m = r;
+        while (nodes[m].left != T)
+            m = nodes[m].left;
+
+        if (nodes[m].start - 1 == end && nodes[m].value == value) {
+            r = remove_min(r, &s, &e, &v);
+            end = e;
+        }
+    }
+
+    return join(start, end, value, l, r);
+}
+
+// Maps [start, end] to value, overwriting whatever was there: O(log n)
+i16 assign(i16 tree, i16 start, i16 end, i16 value)
+{
+    return join_equal(start, end, value, split_lt(tree, start), split_gt(tree, end));
+}
+
+// Unmaps [start, end]
+i16 erase(i16 tree, i16 start, i16 end)
+{
+    return concat(split_lt(tree, start), split_gt(tree, end));
+}
+
+i16 lookup(i16 tree, i16 x)
+{
+    while (tree != T) {
+        if (x < nodes[tree].start)
+            tree = nodes[tree].left;
+        else if (x > nodes[tree].end)
+            tree = nodes[tree].right;
+        else
+            return nodes[tree].value;
+    }
+
+    return NONE;
+}
+
+// Called by walk_runs for one piece of the walked range, value is NONE for
+// a gap
+typedef void (*visit_fn)(i16 start, i16 end, i16 value, void* ctx);
+
+void walk_from(i16 tree, i16 start, i16 end, i16* cursor, visit_fn visit, void* ctx)
+{
+    if (tree == T)
+        return;
+
+    i16 s = nodes[tree].start;
+    i16 e = nodes[tree].end;
+
+    if (start < s)
+        walk_from(nodes[tree].left, start, end, cursor, visit, ctx);
+
+    if (s <= end && e >= start) {
+        if (*cursor < s)
+            visit(*cursor, s - 1, NONE, ctx);
+
+        visit(max(s, start), e < end ? e : end, nodes[tree].value, ctx);
+
+        *cursor = e + 1;
+    }
+
+    if (end > e)
+        walk_from(nodes[tree].right, start, end, cursor, visit, ctx);
+}
+
+// Cuts [start, end] into the runs of tree and the gaps between them, each
+// clipped to [start, end], and visits them in order. The tree isn't
+// touched, so visit may assign into a copy of it: O(k + log n) for k runs
+void walk_runs(i16 tree, i16 start, i16 end, visit_fn visit, void* ctx)
+{
+    i16 cursor = start;
+
+    walk_from(tree, start, end, &cursor, visit, ctx);
+
+    if (cursor <= end)
+        visit(cursor, end, NONE, ctx);
+}
+
+// Grows a run out of pieces that touch and share a key, and hands it to
+// emit once a piece doesn't fit
+struct coalescer {
+    void (*emit)(i16 start, i16 end, i16 key);
+    i16 start;
+    i16 end;
+    i16 key;
+};
+
+void coalesce_flush(struct coalescer* c)
+{
+    if (c->start <= c->end)
+        c->emit(c->start, c->end, c->key);
+
+    c->start = 0;
+    c->end = -1;
+}
+
+void coalesce(struct coalescer* c, i16 start, i16 end, i16 key)
+{
+    if (c->start <= c->end && c->end + 1 == start && c->key == key) {
+        c->end = end;
+        return;
+    }
+
+    coalesce_flush(c);
+
+    c->start = start;
+    c->end = end;
+    c->key = key;
+}
+
+void mark(i16 tree, bool* marked)
+{
+    while (tree != T && !marked[tree]) {
+        marked[tree] = true;
+        mark(nodes[tree].left, marked);
+        tree = nodes[tree].right;
+    }
+}
+
+// Reclaims the nodes unreachable from the root, see diet_gc in diet3.c
+void map_gc()
+{
+    static bool marked[N];
+    static i16 forward[N];
+
+    memset(marked, 0, sizeof(marked));
+
+    mark(root, marked);
+
+    i16 live = 0;
+
+    for (i16 i = 0; i < len; ++i) {
+        if (!marked[i])
+            continue;
+
+        i16 l = nodes[i].left;
+        i16 r = nodes[i].right;
+
+        nodes[live] = nodes[i];
+        nodes[live].left = l == T ? T : forward[l];
+        nodes[live].right = r == T ? T : forward[r];
+
+        forward[i] = live++;
+    }
+
+    len = live;
+
+    if (root != T)
+        root = forward[root];
+}
+
+void printer(i16 x, int level, int dir)
+{
+    if (x == T)
+        return;
+
+    for (int i = 1; i <= level * 4 - 1; ++i)
+        printf(" ");
+
+    if (dir == -1)
+        printf("l");
+    else if (dir == 1)
+        printf("r");
+
+    printf("[%d,%d]=%d\n", nodes[x].start, nodes[x].end, nodes[x].value);
+
+    printer(nodes[x].right, level + 1, 1);
+    printer(nodes[x].left, level + 1, -1);
+}
+
+void print()
+{
+    printer(root, 0, 0);
+}
+
+void gather_in_order(i16 x, i16* values, int* num)
+{
+    if (x == T)
+        return;
+
+    gather_in_order(nodes[x].left, values, num);
+    values[(*num)++] = x;
+    gather_in_order(nodes[x].right, values, num);
+}
+
+i16 check_balance(i16 x)
+{
+    if (x == T)
+        return 0;
+
+    i16 l = check_balance(nodes[x].left);
+    i16 r = check_balance(nodes[x].right);
+
+    assert(l <= r + bal_const && r <= l + bal_const);
+    assert(nodes[x].height == 1 + max(l, r));
+
+    return nodes[x].height;
+}
+
+// In order, the intervals must be disjoint, and touching ones must differ
+// in value, otherwise they should have been merged
+void check_runs(i16 tree)
+{
+    i16 values[N];
+    int num = 0;
+
+    gather_in_order(tree, values, &num);
+
+    for (int i = 0; i < num; ++i) {
+        struct node* x = &nodes[values[i]];
+
+        assert(x->start <= x->end);
+        assert(x->value != NONE);
+
+        if (i == 0)
+            continue;
+
+        struct node* p = &nodes[values[i - 1]];
+
+        assert(p->end < x->start);
+        assert(p->end + 1 < x->start || p->value != x->value);
+    }
+}
+
+void check_map(i16 tree, i16* expected)
+{
+    check_balance(tree);
+    check_runs(tree);
+
+    for (i16 i = 0; i < MASK_LEN; ++i) {
+        if (lookup(tree, i) != expected[i]) {
+            printer(tree, 0, 0);
+            printf("at %d: %d != %d\n", i, lookup(tree, i), expected[i]);
+        }
+
+        assert(lookup(tree, i) == expected[i]);
+    }
+}
+
+#define MAX_RUNS 64
+
+// Runs handed out by an update (blits, layers), recorded by the tests of
+// the files built on this one
+struct recorded_run {
+    i16 start;
+    i16 end;
+    i16 key;
+};
+
+struct recorded_run runs[MAX_RUNS];
+int num_runs;
+
+void record_run(i16 start, i16 end, i16 key)
+{
+    assert(num_runs < MAX_RUNS);
+
+    runs[num_runs++] = (struct recorded_run){ start, end, key };
+}
+
+// Paints the recorded runs' keys into pixels, NONE elsewhere. The runs must
+// be in order and maximal, touching ones differ in key
+void runs_to_pixels(i16* pixels)
+{
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        pixels[i] = NONE;
+
+    for (int r = 0; r < num_runs; ++r) {
+        struct recorded_run* x = &runs[r];
+
+        assert(x->start <= x->end);
+
+        if (r > 0) {
+            struct recorded_run* p = &runs[r - 1];
+
+            assert(p->end < x->start);
+            assert(p->end + 1 < x->start || p->key != x->key);
+        }
+
+        for (i16 i = x->start; i <= x->end; ++i)
+            pixels[i] = x->key;
+    }
+}
+
+#ifndef NO_MAIN
+
+void clear(i16* expected)
+{
+    root = T;
+    len = 0;
+
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        expected[i] = NONE;
+}
+
+void test_assign(i16* expected, i16 start, i16 end, i16 value)
+{
+    root = assign(root, start, end, value);
+
+    for (i16 i = start; i <= end; ++i)
+        expected[i] = value;
+
+    print();
+    check_map(root, expected);
+    printf("\n");
+}
+
+struct walk_check {
+    i16* expected;
+    i16 cursor;
+    i16 last_value;
+};
+
+void visit_check(i16 start, i16 end, i16 value, void* ctx)
+{
+    struct walk_check* w = ctx;
+
+    // Pieces come in order without holes, and a gap never follows a gap
+    assert(start == w->cursor && start <= end);
+    assert(value != NONE || w->last_value != NONE);
+
+    for (i16 i = start; i <= end; ++i)
+        assert(w->expected[i] == value);
+
+    w->cursor = end + 1;
+    w->last_value = value;
+}
+
+// Walking a random range must visit it exactly, piece by piece
+void check_walk(i16 tree, i16* expected)
+{
+    i16 start = rand() % MASK_LEN;
+    i16 end = start + rand() % MASK_LEN;
+
+    if (end > TEST_MAX_VAL)
+        end = TEST_MAX_VAL;
+
+    struct walk_check w = { expected, start, 0 };
+
+    walk_runs(tree, start, end, visit_check, &w);
+
+    assert(w.cursor == end + 1);
+}
+
+void test_cases()
+{
+    i16 expected[MASK_LEN];
+
+    // Equal neighbours merge, different ones stay apart
+    clear(expected);
+    test_assign(expected, 2, 5, 1);
+    test_assign(expected, 6, 8, 1);
+    test_assign(expected, 9, 12, 2);
+    test_assign(expected, 13, 14, 1);
+    assert(len > 0 && nodes[root].height == 2);
+
+    // Overwriting the middle of a run splits it in three
+    clear(expected);
+    test_assign(expected, 0, 20, 1);
+    test_assign(expected, 8, 10, 2);
+
+    // Writing the old value back heals the split
+    test_assign(expected, 8, 10, 1);
+    assert(nodes[root].start == 0 && nodes[root].end == 20);
+    assert(nodes[root].left == T && nodes[root].right == T);
+
+    // Overwriting several runs at once, bridging equal neighbours
+    clear(expected);
+    test_assign(expected, 1, 3, 1);
+    test_assign(expected, 5, 7, 2);
+    test_assign(expected, 9, 11, 0);
+    test_assign(expected, 13, 15, 1);
+    test_assign(expected, 4, 12, 1);
+    assert(nodes[root].start == 1 && nodes[root].end == 15);
+}
+
+void test_random()
+{
+    i16 expected[MASK_LEN];
+
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear(expected);
+
+        for (int op = 0; op < 40; ++op) {
+            i16 start = rand() % MASK_LEN;
+            i16 end = start + rand() % 8;
+
+            if (end > TEST_MAX_VAL)
+                end = TEST_MAX_VAL;
+
+            if (rand() % 4 == 0) {
+                root = erase(root, start, end);
+
+                for (i16 i = start; i <= end; ++i)
+                    expected[i] = NONE;
+            } else {
+                i16 value = rand() % TEST_VALUES;
+
+                root = assign(root, start, end, value);
+
+                for (i16 i = start; i <= end; ++i)
+                    expected[i] = value;
+            }
+
+            check_map(root, expected);
+            check_walk(root, expected);
+
+            if (len > N / 2)
+                map_gc();
+        }
+    }
+}
+
+// A voxel column of materials: a few strata, then a tunnel dug through
+// them and a block placed back, as World edits would do
+void test_column()
+{
+    int height = 256;
+    int naive = height;
+
+    root = T;
+    len = 0;
+
+    root = assign(root, 0, 59, 1);
+    root = assign(root, 60, 119, 2);
+    root = assign(root, 120, 127, 3);
+    root = erase(root, 50, 70);
+    root = assign(root, 60, 60, 4);
+    map_gc();
+
+    i16 values[N];
+    int num = 0;
+
+    gather_in_order(root, values, &num);
+
+    printf("column: %d runs, %d nodes, %zu bytes vs %zu bytes for a voxel array\n",
+            num, len, len * sizeof(struct node), naive * sizeof(uint32_t));
+
+    assert(num == 4);
+    assert(lookup(root, 49) == 1);
+    assert(lookup(root, 55) == NONE);
+    assert(lookup(root, 60) == 4);
+    assert(lookup(root, 71) == 2);
+    assert(lookup(root, 128) == NONE);
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+    test_column();
+
+    printf("diet_map: all tests passed\n");
+}
+
+#endif
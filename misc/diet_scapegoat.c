@@ -0,0 +1,582 @@
+// Discrete Interval Encoding Tree based on a scapegoat tree
+//
+// Same blit contract as diet3.c: an insert blits exactly the pixels of the
+// new interval that weren't covered yet. Nodes are only (start, end, left,
+// right), 8 bytes against diet3's 10, and an insert does no balance work on
+// the way down. When a new leaf lands deeper than log_{3/2} of the node
+// count, the lowest ancestor whose child outweighs 2/3 of it is flattened
+// and rebuilt perfectly balanced. When merges have dropped the count below
+// 2/3 of its peak, the whole tree is. Rebuilds hand out nodes in preorder,
+// lowest index first, so parents come before their children in memory, and
+// a whole tree rebuild packs the pool from index 0 again
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define i16 int16_t
+
+#define TEST_MAX_VAL 30
+#define START_RAND 20
+#define SIZE_RAND 10
+#define MASK_LEN (TEST_MAX_VAL + 1)
+
+void blit(i16 start, i16 end);
+
+struct node {
+    i16 start;
+    i16 end;
+    i16 left;
+    i16 right;
+};
+
+#ifndef N
+#define N 1000
+#endif
+#define T INT16_MAX
+
+// Deeper than any leaf can get with N nodes, log_{3/2} N + 1
+#define MAX_DEPTH 32
+
+// The tree is updated in place, nodes it drops go on a free list threaded
+// through left. size is the number of nodes in the tree, max_size its peak
+// since the last whole tree rebuild
+i16 len = 0;
+i16 root = T;
+i16 free_list = T;
+i16 size = 0;
+i16 max_size = 0;
+struct node nodes[N];
+
+// min_size[d]: the fewest nodes a tree may have with a leaf at depth d,
+// ceil((3/2)^d), so the depth check on insert is one load
+int min_size[MAX_DEPTH];
+
+// Rebuild scratch: the intervals of a subtree in order, and its nodes
+struct span {
+    i16 start;
+    i16 end;
+};
+
+struct span spans[N];
+i16 slots[N];
+
+#ifdef STATS
+struct stats stats;
+#endif
+
+i16 new_node(i16 start, i16 end)
+{
+    i16 n = free_list;
+
+    if (n != T) {
+        free_list = nodes[n].left;
+    } else {
+        assert(len < N);
+        n = len++;
+    }
+
+    STAT(stats.nodes++);
+
+    nodes[n].start = start;
+    nodes[n].end = end;
+    nodes[n].left = T;
+    nodes[n].right = T;
+
+    ++size;
+
+    if (size > max_size)
+        max_size = size;
+
+    return n;
+}
+
+void free_node(i16 n)
+{
+    nodes[n].left = free_list;
+    free_list = n;
+
+    --size;
+}
+
+void blit_run(i16 start, i16 end)
+{
+    if (start > end)
+        return;
+
+    STAT(stat_blit(&stats, start, end));
+
+    blit(start, end);
+}
+
+int subtree_size(i16 tree)
+{
+    if (tree == T)
+        return 0;
+
+    return 1 + subtree_size(nodes[tree].left) + subtree_size(nodes[tree].right);
+}
+
+void gather(i16 tree, int* k)
+{
+    if (tree == T)
+        return;
+
+    gather(nodes[tree].left, k);
+
+    spans[*k] = (struct span){ nodes[tree].start, nodes[tree].end };
+    slots[*k] = tree;
+    ++*k;
+
+    gather(nodes[tree].right, k);
+}
+
+int compare_slots(const void* a, const void* b)
+{
+    return *(const i16*)a - *(const i16*)b;
+}
+
+// Builds spans[lo..hi] into a perfectly balanced tree, taking nodes from
+// slots in preorder
+i16 build(int lo, int hi, int* next)
+{
+    if (lo > hi)
+        return T;
+
+    int mid = (lo + hi) / 2;
+    i16 x = slots[(*next)++];
+
+    nodes[x].start = spans[mid].start;
+    nodes[x].end = spans[mid].end;
+    nodes[x].left = build(lo, mid - 1, next);
+    nodes[x].right = build(mid + 1, hi, next);
+
+    return x;
+}
+
+// Rebuilds a subtree of n nodes on the nodes it already has
+i16 rebuild(i16 tree, int n)
+{
+    int k = 0;
+    int next = 0;
+
+    gather(tree, &k);
+    assert(k == n);
+
+    qsort(slots, n, sizeof(i16), compare_slots);
+
+    return build(0, n - 1, &next);
+}
+
+// Rebuilds the whole tree onto nodes 0 to size - 1, which empties the free
+// list
+void rebuild_all()
+{
+    int k = 0;
+    int next = 0;
+
+    gather(root, &k);
+    assert(k == size);
+
+    for (int i = 0; i < k; ++i)
+        slots[i] = i;
+
+    root = build(0, k - 1, &next);
+    len = k;
+    free_list = T;
+    max_size = size;
+}
+
+// Blits the gaps between the intervals of a subtree that is being absorbed,
+// in order, starting from *cursor, and frees its nodes
+void absorb(i16 tree, i16* cursor)
+{
+    if (tree == T)
+        return;
+
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    absorb(l, cursor);
+    blit_run(*cursor, nodes[tree].start - 1);
+    *cursor = nodes[tree].end + 1;
+    free_node(tree);
+    absorb(r, cursor);
+}
+
+// Absorbs the intervals of the subtree at *link that end at lo - 1 or
+// later. They are all at its high end, so what stays is still a subtree
+void trim_high(i16* link, i16 lo, i16* cursor, i16* new_start)
+{
+    STAT_FRAME(stats);
+
+    i16 y = *link;
+
+    if (y == T)
+        return;
+
+    if (nodes[y].end + 1 < lo) {
+        trim_high(&nodes[y].right, lo, cursor, new_start);
+        return;
+    }
+
+    trim_high(&nodes[y].left, lo, cursor, new_start);
+
+    blit_run(*cursor, nodes[y].start - 1);
+    *cursor = nodes[y].end + 1;
+
+    if (nodes[y].start < *new_start)
+        *new_start = nodes[y].start;
+
+    absorb(nodes[y].right, cursor);
+
+    *link = nodes[y].left;
+    free_node(y);
+}
+
+// Absorbs the intervals of the subtree at *link that start at hi + 1 or
+// earlier, all at its low end
+void trim_low(i16* link, i16 hi, i16* cursor, i16* new_end)
+{
+    STAT_FRAME(stats);
+
+    i16 y = *link;
+
+    if (y == T)
+        return;
+
+    if (nodes[y].start - 1 > hi) {
+        trim_low(&nodes[y].left, hi, cursor, new_end);
+        return;
+    }
+
+    absorb(nodes[y].left, cursor);
+
+    blit_run(*cursor, nodes[y].start - 1);
+    *cursor = nodes[y].end + 1;
+
+    if (nodes[y].end > *new_end)
+        *new_end = nodes[y].end;
+
+    trim_low(&nodes[y].right, hi, cursor, new_end);
+
+    *link = nodes[y].right;
+    free_node(y);
+}
+
+// Grows x, which overlaps or touches [start, end], over it and every other
+// interval it reaches. Those can only be in x's subtrees
+void merge_into(i16 x, i16 start, i16 end)
+{
+    i16 cursor = start;
+    i16 new_start = start < nodes[x].start ? start : nodes[x].start;
+    i16 new_end = end > nodes[x].end ? end : nodes[x].end;
+
+    trim_high(&nodes[x].left, start, &cursor, &new_start);
+
+    blit_run(cursor, nodes[x].start - 1);
+
+    if (nodes[x].end + 1 > cursor)
+        cursor = nodes[x].end + 1;
+
+    trim_low(&nodes[x].right, end, &cursor, &new_end);
+
+    blit_run(cursor, end);
+
+    nodes[x].start = new_start;
+    nodes[x].end = new_end;
+
+    if (3 * size < 2 * max_size)
+        rebuild_all();
+}
+
+// The new leaf at the end of path is too deep, so some ancestor has a child
+// heavier than 2/3 of it. Rebuilds the lowest one
+void rebuild_scapegoat(i16* path, int depth, i16 leaf)
+{
+    int child_size = 1;
+    i16 child = leaf;
+
+    for (int i = depth - 1; i >= 0; --i) {
+        i16 a = path[i];
+        i16 sibling = nodes[a].left == child ? nodes[a].right : nodes[a].left;
+        int a_size = 1 + child_size + subtree_size(sibling);
+
+        if (3 * child_size > 2 * a_size) {
+            i16 rebuilt = rebuild(a, a_size);
+
+            if (i == 0)
+                root = rebuilt;
+            else if (nodes[path[i - 1]].left == a)
+                nodes[path[i - 1]].left = rebuilt;
+            else
+                nodes[path[i - 1]].right = rebuilt;
+
+            return;
+        }
+
+        child_size = a_size;
+        child = a;
+    }
+
+    assert(false);
+}
+
+void insert(i16 start, i16 end)
+{
+    i16 path[MAX_DEPTH];
+    int depth = 0;
+    i16* link = &root;
+
+    while (*link != T) {
+        i16 x = *link;
+
+        if (nodes[x].end + 1 < start) {
+            link = &nodes[x].right;
+        } else if (nodes[x].start - 1 > end) {
+            link = &nodes[x].left;
+        } else {
+            merge_into(x, start, end);
+            STAT(stat_insert_done(&stats));
+            return;
+        }
+
+        assert(depth < MAX_DEPTH);
+        path[depth++] = x;
+    }
+
+    i16 leaf = new_node(start, end);
+
+    *link = leaf;
+    blit_run(start, end);
+
+    if (depth >= MAX_DEPTH || size < min_size[depth])
+        rebuild_scapegoat(path, depth, leaf);
+
+    STAT(stat_insert_done(&stats));
+}
+
+void clear()
+{
+    root = T;
+    len = 0;
+    free_list = T;
+    size = 0;
+    max_size = 0;
+
+    // 3^d / 2^d, exact in 64 bits up to MAX_DEPTH
+    long long num = 1;
+    long long den = 1;
+
+    for (int d = 0; d < MAX_DEPTH; ++d) {
+        min_size[d] = (num + den - 1) / den;
+        num *= 3;
+        den *= 2;
+    }
+}
+
+#ifndef NO_MAIN
+
+// Long enough for a tree deep enough to need scapegoats
+#define LONG_LEN 2000
+
+uint8_t mask[LONG_LEN];
+uint8_t expected[MASK_LEN];
+
+void blit(i16 start, i16 end)
+{
+    assert(0 <= start && end < LONG_LEN);
+
+    for (i16 i = start; i <= end; ++i) {
+        // Every pixel is blitted at most once
+        assert(mask[i] == 0);
+        mask[i] = 1;
+    }
+}
+
+void fill_bits(i16 tree, uint8_t* bits)
+{
+    if (tree == T)
+        return;
+
+    for (i16 i = nodes[tree].start; i <= nodes[tree].end; ++i)
+        bits[i] = 1;
+
+    fill_bits(nodes[tree].left, bits);
+    fill_bits(nodes[tree].right, bits);
+}
+
+int height(i16 tree)
+{
+    if (tree == T)
+        return 0;
+
+    int l = height(nodes[tree].left);
+    int r = height(nodes[tree].right);
+
+    return 1 + (l > r ? l : r);
+}
+
+// In order the intervals are disjoint and not adjacent
+void check_order(i16 tree, i16 lo, i16 hi)
+{
+    if (tree == T)
+        return;
+
+    struct node* x = &nodes[tree];
+
+    assert(x->start <= x->end);
+    assert(x->start > lo + 1 && x->end < hi - 1);
+
+    check_order(x->left, lo, x->start);
+    check_order(x->right, x->end, hi);
+}
+
+// The counts match the tree, and no leaf is deeper than log_{3/2} of the
+// peak count, plus one
+void check_tree()
+{
+    assert(subtree_size(root) == size);
+    assert(size <= max_size && 3 * size >= 2 * max_size);
+
+    int h = height(root);
+
+    assert(h <= 1 || max_size >= min_size[h - 2]);
+}
+
+// Blits must be exactly the pixels that weren't covered, the tree exactly
+// the pixels inserted so far
+void check_insert(i16 start, i16 end)
+{
+    uint8_t bits[MASK_LEN] = { 0 };
+
+    memset(mask, 0, MASK_LEN);
+
+    insert(start, end);
+
+    for (i16 i = 0; i < MASK_LEN; ++i) {
+        bool fresh = i >= start && i <= end && !expected[i];
+
+        assert(mask[i] == fresh);
+    }
+
+    for (i16 i = start; i <= end; ++i)
+        expected[i] = 1;
+
+    fill_bits(root, bits);
+    assert(memcmp(bits, expected, MASK_LEN) == 0);
+
+    check_order(root, -2, MASK_LEN + 1);
+    check_tree();
+}
+
+void test_cases()
+{
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(2, 5);
+    check_insert(6, 8);
+    assert(nodes[root].start == 2 && nodes[root].end == 8);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 3);
+    check_insert(7, 9);
+    check_insert(13, 15);
+    check_insert(19, 21);
+    check_insert(24, 26);
+    check_insert(2, 25);
+    assert(nodes[root].start == 1 && nodes[root].end == 26);
+    assert(size == 1 && len == 1);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 1);
+    check_insert(3, 3);
+    check_insert(5, 5);
+    check_insert(6, 6);
+    check_insert(9, 12);
+    check_insert(14, 16);
+    check_insert(13, 18);
+    check_insert(2, 2);
+
+    // All the nodes dropped on the way were reused
+    assert(len <= 6);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (int op = 0; op < 20; ++op) {
+            i16 start = rand() % START_RAND;
+            i16 end = start + rand() % SIZE_RAND;
+
+            check_insert(start, end);
+        }
+    }
+}
+
+void test_sorted()
+{
+    for (int test = 0; test < 100; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (i16 start = 0; start < TEST_MAX_VAL; start += 1 + rand() % 3)
+            check_insert(start, start + rand() % 2);
+    }
+}
+
+// Sorted single pixels are the worst case for an unbalanced tree, they make
+// a scapegoat on every few inserts. Filling the gaps merges it all back
+// into one node
+void test_long()
+{
+    clear();
+    memset(mask, 0, LONG_LEN);
+
+    for (i16 i = 0; i < LONG_LEN; i += 2) {
+        insert(i, i);
+        check_tree();
+    }
+
+    assert(size == LONG_LEN / 2);
+    check_order(root, -2, LONG_LEN + 1);
+
+    for (i16 i = 1; i < LONG_LEN; i += 2) {
+        insert(i, i);
+        check_tree();
+    }
+
+    for (i16 i = 0; i < LONG_LEN; ++i)
+        assert(mask[i] == 1);
+
+    assert(size == 1 && len == 1);
+    assert(nodes[root].start == 0 && nodes[root].end == LONG_LEN - 1);
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+    test_sorted();
+    test_long();
+
+#ifdef STATS
+    stats_dump("diet_scapegoat", &stats);
+#endif
+
+    printf("diet_scapegoat: all tests passed\n");
+}
+
+#endif
@@ -0,0 +1,701 @@
+// Interval set on a skip list that several threads can insert into at once,
+// without locks
+//
+// Same blit contract as diet3.c, across threads: an insert blits exactly the
+// pixels of the new interval that no insert had covered yet, so every pixel
+// is blitted once, by whichever thread got to it first. Level 0 is a sorted
+// list of disjoint intervals. A node's end and its level 0 next share one
+// 64-bit word that only changes by CAS. Growing a node over the gap after it
+// and linking a new node into that gap swap the same word, so two threads
+// never both claim a pixel. Intervals that end up adjacent are merged by
+// marking the later one, which freezes its word, then swapping it out of
+// the earlier one's word along with its end, as with the deletion marks of
+// Harris' lock-free lists. Whoever walks past a marked node finishes the
+// merge.
+//
+// Levels 1 and up are only an index to find where to start walking level 0.
+// They may still point at merged nodes, searches skip and unlink those.
+// Nodes aren't reused until clear(), so a word never comes back to a value
+// it had and CAS can't be fooled by ABA
+
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define i16 int16_t
+
+#define TEST_MAX_VAL 30
+#define START_RAND 20
+#define SIZE_RAND 10
+#define MASK_LEN (TEST_MAX_VAL + 1)
+
+void blit(i16 start, i16 end);
+
+// The self-test yields here, between reading a word and swapping it, so
+// threads interleave on a single core too
+#ifndef NO_MAIN
+void contend();
+#else
+#define contend()
+#endif
+
+#define MAX_LEVEL 8
+
+struct node {
+    // Fixed once the node is linked
+    i16 start;
+    i16 level;
+    // end | next << 16 | MARK, see pack()
+    _Atomic uint64_t word;
+    // Next on levels 1 to level - 1
+    _Atomic i16 links[MAX_LEVEL];
+};
+
+#ifndef N
+#define N 32000
+#endif
+#define T INT16_MAX
+#define HEAD 0
+#define MARK ((uint64_t)1 << 32)
+
+// nodes[HEAD] starts and ends before any pixel, clear() sets it up and has
+// to be called before the first insert
+atomic_int len;
+struct node nodes[N];
+
+i16 max(i16 a, i16 b)
+{
+    return a > b ? a : b;
+}
+
+uint64_t pack(i16 end, i16 next)
+{
+    return (uint16_t)end | (uint64_t)(uint16_t)next << 16;
+}
+
+i16 word_end(uint64_t w)
+{
+    return (i16)(uint16_t)w;
+}
+
+i16 word_next(uint64_t w)
+{
+    return (i16)(uint16_t)(w >> 16);
+}
+
+// One level in four goes up, from the murmur3 finalizer of the start, so no
+// thread needs random state
+i16 level_of(i16 start)
+{
+    uint32_t x = (uint16_t)start;
+
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+
+    i16 level = 1;
+
+    while (level < MAX_LEVEL && (x & 3) == 0) {
+        ++level;
+        x >>= 2;
+    }
+
+    return level;
+}
+
+i16 new_node()
+{
+    int n = atomic_fetch_add(&len, 1);
+
+    assert(n < N);
+
+    return n;
+}
+
+// Only for nodes no other thread can see yet, linking them publishes this
+void init_node(i16 n, i16 start, i16 end, i16 next)
+{
+    nodes[n].start = start;
+    nodes[n].level = level_of(start);
+    atomic_store_explicit(&nodes[n].word, pack(end, next), memory_order_relaxed);
+
+    for (int l = 1; l < MAX_LEVEL; ++l)
+        atomic_store_explicit(&nodes[n].links[l], T, memory_order_relaxed);
+}
+
+// The last unmerged node that starts at or before key on level to_level,
+// walking down from the top. Merged nodes on the way are unlinked from the
+// index
+i16 descend(i16 key, int to_level)
+{
+    i16 p = HEAD;
+
+    for (int l = MAX_LEVEL - 1; l >= to_level; --l) {
+        while (1) {
+            i16 x = atomic_load(&nodes[p].links[l]);
+
+            if (x == T || nodes[x].start > key)
+                break;
+
+            if (atomic_load(&nodes[x].word) & MARK) {
+                i16 next = atomic_load(&nodes[x].links[l]);
+
+                atomic_compare_exchange_strong(&nodes[p].links[l], &x, next);
+                continue;
+            }
+
+            p = x;
+        }
+    }
+
+    return p;
+}
+
+// Marks q, which must touch the end of the node before it, and returns its
+// frozen word
+uint64_t freeze(i16 q)
+{
+    uint64_t qw = atomic_load(&nodes[q].word);
+
+    while (!(qw & MARK)) {
+        contend();
+
+        if (atomic_compare_exchange_weak(&nodes[q].word, &qw, qw | MARK))
+            qw |= MARK;
+    }
+
+    return qw;
+}
+
+// The node on level 0 whose interval holds key, or the last one before key,
+// and its unmarked word as it was read. Finishes the merges it walks past,
+// and starts the ones that were left undone
+i16 find(i16 key, uint64_t* word)
+{
+    i16 p = descend(key, 1);
+
+    while (1) {
+        uint64_t w = atomic_load(&nodes[p].word);
+
+        if (w & MARK) {
+            // p was merged into the node before it meanwhile
+            p = descend(key, 1);
+            continue;
+        }
+
+        i16 q = word_next(w);
+
+        if (q == T) {
+            *word = w;
+            return p;
+        }
+
+        uint64_t qw = atomic_load(&nodes[q].word);
+
+        if (qw & MARK) {
+            uint64_t merged = pack(max(word_end(w), word_end(qw)), word_next(qw));
+
+            atomic_compare_exchange_strong(&nodes[p].word, &w, merged);
+            continue;
+        }
+
+        if (word_end(w) + 1 == nodes[q].start) {
+            // A merge lost a race with a change to p, redo it
+            freeze(q);
+            continue;
+        }
+
+        if (nodes[q].start > key) {
+            *word = w;
+            return p;
+        }
+
+        p = q;
+    }
+}
+
+// Folds the nodes after owner that it now touches into it. Stops when owner
+// changes, the merges left over are finished by the next walk past them
+void merge_next(i16 owner)
+{
+    while (1) {
+        uint64_t w = atomic_load(&nodes[owner].word);
+        i16 q = word_next(w);
+
+        if ((w & MARK) || q == T || word_end(w) + 1 < nodes[q].start)
+            return;
+
+        uint64_t qw = freeze(q);
+        uint64_t merged = pack(max(word_end(w), word_end(qw)), word_next(qw));
+
+        if (!atomic_compare_exchange_strong(&nodes[owner].word, &w, merged))
+            return;
+    }
+}
+
+// Links a new node into the index levels it was dealt. Losing it to a
+// concurrent unlink only makes searches a bit longer
+void link_index(i16 c)
+{
+    i16 start = nodes[c].start;
+
+    for (int l = 1; l < nodes[c].level; ++l) {
+        while (1) {
+            if (atomic_load(&nodes[c].word) & MARK)
+                return;
+
+            i16 p = descend(start - 1, l);
+            i16 next = atomic_load(&nodes[p].links[l]);
+
+            if (next != T && nodes[next].start < start)
+                continue;
+
+            atomic_store(&nodes[c].links[l], next);
+
+            if (atomic_compare_exchange_strong(&nodes[p].links[l], &next, c))
+                break;
+        }
+    }
+}
+
+// Claims the gaps in [start, end] one at a time from the left, by growing
+// the node before a gap when the gap starts right after it, or by linking a
+// new node into it. Pixels must not be negative
+void insert(i16 start, i16 end)
+{
+    i16 cursor = start;
+    // A node that was lost with a CAS, no one else saw it
+    i16 spare = T;
+
+    assert(start >= 0);
+
+    while (cursor <= end) {
+        uint64_t w;
+        i16 p = find(cursor, &w);
+        i16 p_end = word_end(w);
+        i16 q = word_next(w);
+
+        if (p_end >= cursor) {
+            cursor = p_end + 1;
+            continue;
+        }
+
+        i16 claim_end = end;
+
+        if (q != T && nodes[q].start - 1 < claim_end)
+            claim_end = nodes[q].start - 1;
+
+        i16 owner = p;
+        uint64_t claimed;
+
+        if (p_end + 1 == cursor) {
+            claimed = pack(claim_end, q);
+        } else {
+            if (spare == T)
+                spare = new_node();
+
+            owner = spare;
+            init_node(owner, cursor, claim_end, q);
+            claimed = pack(p_end, owner);
+        }
+
+        contend();
+
+        if (!atomic_compare_exchange_strong(&nodes[p].word, &w, claimed))
+            continue;
+
+        blit(cursor, claim_end);
+
+        if (owner != p) {
+            spare = T;
+            link_index(owner);
+        }
+
+        if (q != T && claim_end + 1 == nodes[q].start)
+            merge_next(owner);
+
+        cursor = claim_end + 1;
+    }
+}
+
+// Not thread safe, the producers have to be done
+void clear()
+{
+    atomic_store(&len, HEAD + 1);
+
+    nodes[HEAD].start = -1;
+    nodes[HEAD].level = MAX_LEVEL;
+    // An end no pixel is next to, so nothing grows the head
+    atomic_store(&nodes[HEAD].word, pack(-2, T));
+
+    for (int l = 1; l < MAX_LEVEL; ++l)
+        atomic_store(&nodes[HEAD].links[l], T);
+}
+
+#ifndef NO_MAIN
+
+#define COLUMN_LEN 16384
+
+#define STRESS_LEN 2048
+#define STRESS_THREADS 4
+#define STRESS_SPANS 500
+#define STRESS_SIZE 24
+
+#define BENCH_SPANS 8192
+#define BENCH_SIZE 16
+#define BENCH_ROUNDS 100
+
+// Which thread blitted every pixel, 0 for none
+_Atomic uint8_t mask[COLUMN_LEN];
+uint8_t expected[COLUMN_LEN];
+
+// The single threaded tests run as thread 1
+_Thread_local uint8_t thread_id = 1;
+_Thread_local unsigned yield_seed;
+bool stress;
+
+void contend()
+{
+    if (stress && rand_r(&yield_seed) % 4 == 0)
+        sched_yield();
+}
+
+void blit(i16 start, i16 end)
+{
+    assert(0 <= start && end < COLUMN_LEN);
+
+    for (i16 i = start; i <= end; ++i) {
+        // Every pixel is blitted at most once, by any thread
+        uint8_t old = atomic_exchange(&mask[i], thread_id);
+
+        assert(old == 0);
+    }
+}
+
+void clear_mask(int n)
+{
+    for (int i = 0; i < n; ++i)
+        atomic_store(&mask[i], 0);
+}
+
+i16 first()
+{
+    return word_next(atomic_load(&nodes[HEAD].word));
+}
+
+i16 next_of(i16 x)
+{
+    return word_next(atomic_load(&nodes[x].word));
+}
+
+i16 end_of(i16 x)
+{
+    return word_end(atomic_load(&nodes[x].word));
+}
+
+int count_nodes()
+{
+    int n = 0;
+
+    for (i16 x = first(); x != T; x = next_of(x))
+        ++n;
+
+    return n;
+}
+
+void fill_bits(uint8_t* bits)
+{
+    for (i16 x = first(); x != T; x = next_of(x))
+        for (i16 i = nodes[x].start; i <= end_of(x); ++i)
+            bits[i] = 1;
+}
+
+// Level 0 is disjoint intervals in order, and once every merge is done none
+// of them touch. Every index level is in order too
+void check_list(bool merged)
+{
+    i16 prev_end = -2;
+
+    for (i16 x = first(); x != T; x = next_of(x)) {
+        uint64_t w = atomic_load(&nodes[x].word);
+
+        assert(nodes[x].start <= word_end(w));
+        assert(prev_end < nodes[x].start);
+
+        if (merged) {
+            assert(!(w & MARK));
+            assert(prev_end + 1 < nodes[x].start);
+        }
+
+        prev_end = word_end(w);
+    }
+
+    for (int l = 1; l < MAX_LEVEL; ++l) {
+        i16 prev_start = -1;
+
+        for (i16 x = nodes[HEAD].links[l]; x != T; x = nodes[x].links[l]) {
+            assert(nodes[x].level > l);
+            assert(prev_start <= nodes[x].start);
+
+            prev_start = nodes[x].start;
+        }
+    }
+}
+
+// Blits must be exactly the pixels that weren't covered, the list exactly
+// the pixels inserted so far
+void check_insert(i16 start, i16 end)
+{
+    uint8_t bits[MASK_LEN] = { 0 };
+
+    clear_mask(MASK_LEN);
+
+    insert(start, end);
+
+    for (i16 i = 0; i < MASK_LEN; ++i) {
+        bool fresh = i >= start && i <= end && !expected[i];
+
+        assert(mask[i] == fresh);
+    }
+
+    for (i16 i = start; i <= end; ++i)
+        expected[i] = 1;
+
+    fill_bits(bits);
+    assert(memcmp(bits, expected, MASK_LEN) == 0);
+
+    check_list(true);
+}
+
+void test_cases()
+{
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(2, 5);
+    check_insert(6, 8);
+    assert(count_nodes() == 1 && nodes[first()].start == 2 && end_of(first()) == 8);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 3);
+    check_insert(7, 9);
+    check_insert(13, 15);
+    check_insert(19, 21);
+    check_insert(24, 26);
+    check_insert(2, 25);
+    assert(count_nodes() == 1 && nodes[first()].start == 1 && end_of(first()) == 26);
+
+    // Filling a gap merges both sides into the node before it
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(10, 12);
+    check_insert(4, 6);
+    check_insert(8, 8);
+    check_insert(7, 7);
+    assert(count_nodes() == 2);
+    check_insert(9, 9);
+    assert(count_nodes() == 1 && nodes[first()].start == 4 && end_of(first()) == 12);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (int op = 0; op < 20; ++op) {
+            i16 start = rand() % START_RAND;
+            i16 end = start + rand() % SIZE_RAND;
+
+            check_insert(start, end);
+        }
+    }
+}
+
+void test_sorted()
+{
+    for (int test = 0; test < 100; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (i16 start = 0; start < TEST_MAX_VAL; start += 1 + rand() % 3)
+            check_insert(start, start + rand() % 2);
+    }
+}
+
+struct producer {
+    pthread_t thread;
+    uint8_t id;
+    unsigned seed;
+    int num_spans;
+    i16 height;
+    i16 max_size;
+};
+
+void next_span(struct producer* p, unsigned* seed, i16* start, i16* end)
+{
+    *start = rand_r(seed) % p->height;
+    *end = *start + rand_r(seed) % p->max_size;
+
+    if (*end >= p->height)
+        *end = p->height - 1;
+}
+
+void* produce(void* arg)
+{
+    struct producer* p = arg;
+    unsigned seed = p->seed;
+
+    thread_id = p->id;
+    yield_seed = p->seed;
+
+    for (int i = 0; i < p->num_spans; ++i) {
+        i16 start, end;
+
+        next_span(p, &seed, &start, &end);
+        insert(start, end);
+    }
+
+    return NULL;
+}
+
+void run_producers(struct producer* producers, int threads)
+{
+    for (int t = 0; t < threads; ++t)
+        pthread_create(&producers[t].thread, NULL, produce, &producers[t]);
+
+    for (int t = 0; t < threads; ++t)
+        pthread_join(producers[t].thread, NULL);
+}
+
+// Every pixel any thread inserted is blitted by exactly one of them, and
+// once a last walk has finished the merges the list is as compact as if one
+// thread had built it
+void test_threads()
+{
+    struct producer producers[STRESS_THREADS];
+
+    for (int test = 0; test < 200; ++test) {
+        clear();
+        clear_mask(STRESS_LEN);
+        memset(expected, 0, STRESS_LEN);
+
+        for (int t = 0; t < STRESS_THREADS; ++t) {
+            producers[t].id = t + 1;
+            producers[t].seed = test * STRESS_THREADS + t;
+            producers[t].num_spans = STRESS_SPANS;
+            producers[t].height = STRESS_LEN;
+            producers[t].max_size = STRESS_SIZE;
+        }
+
+        stress = true;
+        run_producers(producers, STRESS_THREADS);
+        stress = false;
+
+        for (int t = 0; t < STRESS_THREADS; ++t) {
+            unsigned seed = producers[t].seed;
+
+            for (int i = 0; i < STRESS_SPANS; ++i) {
+                i16 start, end;
+
+                next_span(&producers[t], &seed, &start, &end);
+                memset(expected + start, 1, end - start + 1);
+            }
+        }
+
+        for (i16 i = 0; i < STRESS_LEN; ++i)
+            assert((mask[i] != 0) == expected[i]);
+
+        uint8_t bits[STRESS_LEN] = { 0 };
+
+        check_list(false);
+        fill_bits(bits);
+        assert(memcmp(bits, expected, STRESS_LEN) == 0);
+
+        uint64_t w;
+        find(T - 1, &w);
+
+        check_list(true);
+    }
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The same spans split between 1 to max_threads producers, a fresh column
+// every round
+void bench_producers(int max_threads)
+{
+    struct producer* producers = calloc(max_threads, sizeof(struct producer));
+    double base = 0;
+
+    for (int threads = 1; threads <= max_threads; ++threads) {
+        double elapsed = 0;
+
+        for (int round = 0; round < BENCH_ROUNDS; ++round) {
+            clear();
+            clear_mask(COLUMN_LEN);
+
+            for (int t = 0; t < threads; ++t) {
+                producers[t].id = t + 1;
+                producers[t].seed = round * max_threads + t;
+                producers[t].num_spans = BENCH_SPANS / threads;
+                producers[t].height = COLUMN_LEN;
+                producers[t].max_size = BENCH_SIZE;
+            }
+
+            double start = now();
+
+            run_producers(producers, threads);
+
+            elapsed += now() - start;
+        }
+
+        if (threads == 1)
+            base = elapsed;
+
+        int inserts = BENCH_SPANS / threads * threads * BENCH_ROUNDS;
+
+        printf("threads=%d time=%.3fs inserts/s=%.0f speedup=%.2f\n", threads, elapsed,
+                inserts / elapsed, base / elapsed);
+    }
+
+    free(producers);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        int max_threads = argc > 2 ? atoi(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+
+        bench_producers(max_threads);
+        return 0;
+    }
+
+    test_cases();
+    test_random();
+    test_sorted();
+    test_threads();
+
+    printf("diet_skiplist: all tests passed\n");
+}
+
+#endif
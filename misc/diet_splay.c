@@ -0,0 +1,442 @@
+// Discrete Interval Encoding Tree based on a splay tree
+//
+// Same blit contract as diet3.c: an insert blits exactly the pixels of the
+// new interval that weren't covered yet. Every insert and query splays the
+// tree around the span it touches, and an inserted interval ends up at the
+// root. The spans of a raycast column keep landing next to the previous
+// ones (floor and ceiling after a wall, neighbouring DDA cells), so most
+// splays are short. Amortized O(log n), no balance information at all
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define i16 int16_t
+
+#define TEST_MAX_VAL 30
+#define START_RAND 20
+#define SIZE_RAND 10
+#define MASK_LEN (TEST_MAX_VAL + 1)
+
+void blit(i16 start, i16 end);
+
+struct node {
+    i16 start;
+    i16 end;
+    i16 left;
+    i16 right;
+};
+
+#ifndef N
+#define N 1000
+#endif
+#define T INT16_MAX
+
+// The tree is updated in place, nodes it drops go on a free list threaded
+// through left
+i16 len = 0;
+i16 root = T;
+i16 free_list = T;
+struct node nodes[N];
+
+#ifdef STATS
+struct stats stats;
+#endif
+
+i16 new_node(i16 start, i16 end, i16 left, i16 right)
+{
+    i16 n = free_list;
+
+    if (n != T) {
+        free_list = nodes[n].left;
+    } else {
+        assert(len < N);
+        n = len++;
+    }
+
+    STAT(stats.nodes++);
+
+    nodes[n].start = start;
+    nodes[n].end = end;
+    nodes[n].left = left;
+    nodes[n].right = right;
+
+    return n;
+}
+
+void free_node(i16 n)
+{
+    nodes[n].left = free_list;
+    free_list = n;
+}
+
+void blit_run(i16 start, i16 end)
+{
+    if (start > end)
+        return;
+
+    STAT(stat_blit(&stats, start, end));
+
+    blit(start, end);
+}
+
+// Top-down splay: brings the interval starting at key to the root, or the
+// last one on the search path, which starts right before or after key.
+// Nodes passed on the way hang off the hooks of the left and right trees
+i16 splay(i16 tree, i16 key)
+{
+    if (tree == T)
+        return T;
+
+    i16 l = T;
+    i16 r = T;
+    i16* lhook = &l;
+    i16* rhook = &r;
+    i16 t = tree;
+
+    while (1) {
+        if (key < nodes[t].start) {
+            i16 c = nodes[t].left;
+
+            if (c == T)
+                break;
+
+            if (key < nodes[c].start) {
+                STAT(stats.rotations++);
+
+                nodes[t].left = nodes[c].right;
+                nodes[c].right = t;
+                t = c;
+
+                if (nodes[t].left == T)
+                    break;
+            }
+
+            *rhook = t;
+            rhook = &nodes[t].left;
+            t = nodes[t].left;
+        } else if (key > nodes[t].start) {
+            i16 c = nodes[t].right;
+
+            if (c == T)
+                break;
+
+            if (key > nodes[c].start) {
+                STAT(stats.rotations++);
+
+                nodes[t].right = nodes[c].left;
+                nodes[c].left = t;
+                t = c;
+
+                if (nodes[t].right == T)
+                    break;
+            }
+
+            *lhook = t;
+            lhook = &nodes[t].right;
+            t = nodes[t].right;
+        } else {
+            break;
+        }
+    }
+
+    *lhook = nodes[t].left;
+    *rhook = nodes[t].right;
+    nodes[t].left = l;
+    nodes[t].right = r;
+
+    return t;
+}
+
+// Splits tree into the intervals that start below key and the rest
+void split(i16 tree, i16 key, i16* l, i16* r)
+{
+    tree = splay(tree, key);
+
+    if (tree == T) {
+        *l = T;
+        *r = T;
+    } else if (nodes[tree].start < key) {
+        *l = tree;
+        *r = nodes[tree].right;
+        nodes[tree].right = T;
+    } else {
+        *l = nodes[tree].left;
+        *r = tree;
+        nodes[tree].left = T;
+    }
+}
+
+// Blits the gaps between the intervals of a subtree that is being absorbed,
+// in order, starting from *blit_start, and frees its nodes
+void absorb(i16 tree, i16* blit_start)
+{
+    if (tree == T)
+        return;
+
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    absorb(l, blit_start);
+    blit_run(*blit_start, nodes[tree].start - 1);
+    *blit_start = nodes[tree].end + 1;
+    free_node(tree);
+    absorb(r, blit_start);
+}
+
+i16 insert_range(i16 tree, i16 start, i16 end)
+{
+    i16 l, m, r;
+
+    // l: everything starting before the interval, m: everything starting
+    // inside it or right after it, r: the rest, which can't touch it
+    split(tree, start, &l, &m);
+    split(m, end + 2, &m, &r);
+
+    i16 blit_start = start;
+
+    // Splaying l for start brings its last interval up, the only one in l
+    // that can reach the new interval
+    l = splay(l, start);
+
+    if (l != T && nodes[l].end + 1 >= start) {
+        i16 x = l;
+
+        blit_start = nodes[x].end + 1;
+        start = nodes[x].start;
+
+        if (nodes[x].end > end)
+            end = nodes[x].end;
+
+        l = nodes[x].left;
+        free_node(x);
+    }
+
+    absorb(m, &blit_start);
+    blit_run(blit_start, end);
+
+    // The last interval absorbed may stick out past the new one
+    if (blit_start - 1 > end)
+        end = blit_start - 1;
+
+    return new_node(start, end, l, r);
+}
+
+void insert(i16 start, i16 end)
+{
+    root = insert_range(root, start, end);
+
+    STAT(stat_insert_done(&stats));
+}
+
+// Whether anything in [start, end] is covered. Splays too, so a query
+// makes the next insert nearby cheap
+bool query(i16 start, i16 end)
+{
+    root = splay(root, start);
+
+    if (root == T)
+        return false;
+
+    if (nodes[root].start < start) {
+        if (nodes[root].end >= start)
+            return true;
+
+        i16 x = nodes[root].right;
+
+        if (x == T)
+            return false;
+
+        while (nodes[x].left != T)
+            x = nodes[x].left;
+
+        return nodes[x].start <= end;
+    } else {
+        if (nodes[root].start <= end)
+            return true;
+
+        i16 x = nodes[root].left;
+
+        if (x == T)
+            return false;
+
+        while (nodes[x].right != T)
+            x = nodes[x].right;
+
+        return nodes[x].end >= start;
+    }
+}
+
+void clear()
+{
+    root = T;
+    len = 0;
+    free_list = T;
+}
+
+#ifndef NO_MAIN
+
+uint8_t mask[MASK_LEN];
+uint8_t expected[MASK_LEN];
+
+void blit(i16 start, i16 end)
+{
+    assert(0 <= start && end < MASK_LEN);
+
+    for (i16 i = start; i <= end; ++i) {
+        // Every pixel is blitted at most once
+        assert(mask[i] == 0);
+        mask[i] = 1;
+    }
+}
+
+void fill_bits(i16 tree, uint8_t* bits)
+{
+    if (tree == T)
+        return;
+
+    for (i16 i = nodes[tree].start; i <= nodes[tree].end; ++i)
+        bits[i] = 1;
+
+    fill_bits(nodes[tree].left, bits);
+    fill_bits(nodes[tree].right, bits);
+}
+
+// In order the intervals are disjoint and not adjacent
+void check_order(i16 tree, i16 lo, i16 hi)
+{
+    if (tree == T)
+        return;
+
+    struct node* x = &nodes[tree];
+
+    assert(x->start <= x->end);
+    assert(x->start > lo + 1 && x->end < hi - 1);
+
+    check_order(x->left, lo, x->start);
+    check_order(x->right, x->end, hi);
+}
+
+// Blits must be exactly the pixels that weren't covered, the tree exactly
+// the pixels inserted so far, and the interval holding the new one the root
+void check_insert(i16 start, i16 end)
+{
+    uint8_t bits[MASK_LEN] = { 0 };
+
+    memset(mask, 0, MASK_LEN);
+
+    insert(start, end);
+
+    for (i16 i = 0; i < MASK_LEN; ++i) {
+        bool fresh = i >= start && i <= end && !expected[i];
+
+        assert(mask[i] == fresh);
+    }
+
+    for (i16 i = start; i <= end; ++i)
+        expected[i] = 1;
+
+    fill_bits(root, bits);
+    assert(memcmp(bits, expected, MASK_LEN) == 0);
+
+    check_order(root, -2, MASK_LEN + 1);
+
+    assert(nodes[root].start <= start && nodes[root].end >= end);
+}
+
+void check_query(i16 start, i16 end)
+{
+    bool covered = false;
+
+    for (i16 i = start; i <= end; ++i)
+        covered |= expected[i];
+
+    assert(query(start, end) == covered);
+
+    check_order(root, -2, MASK_LEN + 1);
+}
+
+void test_cases()
+{
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(2, 5);
+    check_insert(6, 8);
+    assert(nodes[root].start == 2 && nodes[root].end == 8);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 3);
+    check_insert(7, 9);
+    check_insert(13, 15);
+    check_insert(19, 21);
+    check_insert(24, 26);
+    check_insert(2, 25);
+    assert(nodes[root].start == 1 && nodes[root].end == 26);
+    assert(nodes[root].left == T && nodes[root].right == T);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 1);
+    check_insert(3, 3);
+    check_insert(5, 5);
+    check_insert(6, 6);
+    check_insert(9, 12);
+    check_insert(14, 16);
+    check_insert(13, 18);
+    check_insert(2, 2);
+
+    // All the nodes dropped on the way were reused
+    assert(len <= 6);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (int op = 0; op < 20; ++op) {
+            i16 start = rand() % START_RAND;
+            i16 end = start + rand() % SIZE_RAND;
+
+            if (rand() % 3 == 0)
+                check_query(start, end);
+            else
+                check_insert(start, end);
+        }
+    }
+}
+
+void test_sorted()
+{
+    for (int test = 0; test < 100; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (i16 start = 0; start < TEST_MAX_VAL; start += 1 + rand() % 3)
+            check_insert(start, start + rand() % 2);
+    }
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+    test_sorted();
+
+#ifdef STATS
+    stats_dump("diet_splay", &stats);
+#endif
+
+    printf("diet_splay: all tests passed\n");
+}
+
+#endif
@@ -0,0 +1,395 @@
+// Discrete Interval Encoding Tree based on a treap
+//
+// Same blit contract as diet3.c: an insert blits exactly the pixels of the
+// new interval that weren't covered yet. Instead of AVL rebalancing it
+// splits the tree around the new interval and merges it back, so there is
+// no height to keep up to date. A node's priority is a hash of its start,
+// which makes the shape depend only on the set, and needs no field
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+#define i16 int16_t
+
+#define TEST_MAX_VAL 30
+#define START_RAND 20
+#define SIZE_RAND 10
+#define MASK_LEN (TEST_MAX_VAL + 1)
+
+void blit(i16 start, i16 end);
+
+struct node {
+    i16 start;
+    i16 end;
+    i16 left;
+    i16 right;
+};
+
+#ifndef N
+#define N 1000
+#endif
+#define T INT16_MAX
+
+// Unlike diet3 the tree is updated in place, nodes it drops go on a free
+// list threaded through left
+i16 len = 0;
+i16 root = T;
+i16 free_list = T;
+struct node nodes[N];
+
+#ifdef STATS
+struct stats stats;
+#endif
+
+// The murmur3 finalizer, a bijection, so distinct starts never tie
+uint32_t priority(i16 start)
+{
+    uint32_t x = (uint16_t)start;
+
+    x ^= x >> 16;
+    x *= 0x85ebca6b;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35;
+    x ^= x >> 16;
+
+    return x;
+}
+
+i16 new_node(i16 start, i16 end)
+{
+    i16 n = free_list;
+
+    if (n != T) {
+        free_list = nodes[n].left;
+    } else {
+        assert(len < N);
+        n = len++;
+    }
+
+    STAT(stats.nodes++);
+
+    nodes[n].start = start;
+    nodes[n].end = end;
+    nodes[n].left = T;
+    nodes[n].right = T;
+
+    return n;
+}
+
+void free_node(i16 n)
+{
+    nodes[n].left = free_list;
+    free_list = n;
+}
+
+void blit_run(i16 start, i16 end)
+{
+    if (start > end)
+        return;
+
+    STAT(stat_blit(&stats, start, end));
+
+    blit(start, end);
+}
+
+// Splits tree into the intervals that start below key and the rest
+void split(i16 tree, i16 key, i16* l, i16* r)
+{
+    STAT_FRAME(stats);
+
+    if (tree == T) {
+        *l = T;
+        *r = T;
+    } else if (nodes[tree].start < key) {
+        split(nodes[tree].right, key, &nodes[tree].right, r);
+        *l = tree;
+    } else {
+        split(nodes[tree].left, key, l, &nodes[tree].left);
+        *r = tree;
+    }
+}
+
+// Joins two trees where everything in l is below everything in r
+i16 merge(i16 l, i16 r)
+{
+    STAT_FRAME(stats);
+
+    if (l == T)
+        return r;
+
+    if (r == T)
+        return l;
+
+    if (priority(nodes[l].start) > priority(nodes[r].start)) {
+        nodes[l].right = merge(nodes[l].right, r);
+        return l;
+    } else {
+        nodes[r].left = merge(l, nodes[r].left);
+        return r;
+    }
+}
+
+// Unlinks the last interval of a non-empty tree. Its left subtree takes its
+// place, and has lower priorities than its parent, so the heap order holds
+i16 remove_max(i16 tree, i16* outs, i16* oute)
+{
+    i16 parent = T;
+    i16 x = tree;
+
+    while (nodes[x].right != T) {
+        parent = x;
+        x = nodes[x].right;
+    }
+
+    *outs = nodes[x].start;
+    *oute = nodes[x].end;
+
+    if (parent == T)
+        tree = nodes[x].left;
+    else
+        nodes[parent].right = nodes[x].left;
+
+    free_node(x);
+
+    return tree;
+}
+
+// Blits the gaps between the intervals of a subtree that is being absorbed,
+// in order, starting from *blit_start, and frees its nodes
+void absorb(i16 tree, i16* blit_start)
+{
+    if (tree == T)
+        return;
+
+    i16 l = nodes[tree].left;
+    i16 r = nodes[tree].right;
+
+    absorb(l, blit_start);
+    blit_run(*blit_start, nodes[tree].start - 1);
+    *blit_start = nodes[tree].end + 1;
+    free_node(tree);
+    absorb(r, blit_start);
+}
+
+i16 insert_range(i16 tree, i16 start, i16 end)
+{
+    i16 l, m, r;
+
+    // l: everything starting before the interval, m: everything starting
+    // inside it or right after it, r: the rest, which can't touch it
+    split(tree, start, &l, &m);
+    split(m, end + 2, &m, &r);
+
+    i16 blit_start = start;
+
+    // Only the last interval of l can reach the new one
+    if (l != T) {
+        i16 x = l;
+        while (nodes[x].right != T)
+            x = nodes[x].right;
+
+        if (nodes[x].end + 1 >= start) {
+            i16 s, e;
+
+            l = remove_max(l, &s, &e);
+
+            if (e + 1 > blit_start)
+                blit_start = e + 1;
+
+            start = s;
+
+            if (e > end)
+                end = e;
+        }
+    }
+
+    // The last interval of m may stick out past the new one
+    if (m != T) {
+        i16 x = m;
+        while (nodes[x].right != T)
+            x = nodes[x].right;
+
+        i16 m_end = nodes[x].end;
+
+        absorb(m, &blit_start);
+        blit_run(blit_start, end);
+
+        if (m_end > end)
+            end = m_end;
+    } else {
+        blit_run(blit_start, end);
+    }
+
+    return merge(merge(l, new_node(start, end)), r);
+}
+
+void insert(i16 start, i16 end)
+{
+    root = insert_range(root, start, end);
+
+    STAT(stat_insert_done(&stats));
+}
+
+void clear()
+{
+    root = T;
+    len = 0;
+    free_list = T;
+}
+
+#ifndef NO_MAIN
+
+uint8_t mask[MASK_LEN];
+uint8_t expected[MASK_LEN];
+
+void blit(i16 start, i16 end)
+{
+    assert(0 <= start && end < MASK_LEN);
+
+    for (i16 i = start; i <= end; ++i) {
+        // Every pixel is blitted at most once
+        assert(mask[i] == 0);
+        mask[i] = 1;
+    }
+}
+
+void fill_bits(i16 tree, uint8_t* bits)
+{
+    if (tree == T)
+        return;
+
+    for (i16 i = nodes[tree].start; i <= nodes[tree].end; ++i)
+        bits[i] = 1;
+
+    fill_bits(nodes[tree].left, bits);
+    fill_bits(nodes[tree].right, bits);
+}
+
+// In order the intervals are disjoint and not adjacent, and every node
+// outranks its children
+void check_treap(i16 tree, i16 lo, i16 hi)
+{
+    if (tree == T)
+        return;
+
+    struct node* x = &nodes[tree];
+
+    assert(x->start <= x->end);
+    assert(x->start > lo + 1 && x->end < hi - 1);
+
+    if (x->left != T)
+        assert(priority(nodes[x->left].start) < priority(x->start));
+
+    if (x->right != T)
+        assert(priority(nodes[x->right].start) < priority(x->start));
+
+    check_treap(x->left, lo, x->start);
+    check_treap(x->right, x->end, hi);
+}
+
+// Blits must be exactly the pixels that weren't covered, the tree exactly
+// the pixels inserted so far
+void check_insert(i16 start, i16 end)
+{
+    uint8_t bits[MASK_LEN] = { 0 };
+
+    memset(mask, 0, MASK_LEN);
+
+    insert(start, end);
+
+    for (i16 i = 0; i < MASK_LEN; ++i) {
+        bool fresh = i >= start && i <= end && !expected[i];
+
+        assert(mask[i] == fresh);
+    }
+
+    for (i16 i = start; i <= end; ++i)
+        expected[i] = 1;
+
+    fill_bits(root, bits);
+    assert(memcmp(bits, expected, MASK_LEN) == 0);
+
+    check_treap(root, -2, MASK_LEN + 1);
+}
+
+void test_cases()
+{
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(2, 5);
+    check_insert(6, 8);
+    assert(nodes[root].start == 2 && nodes[root].end == 8);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 3);
+    check_insert(7, 9);
+    check_insert(13, 15);
+    check_insert(19, 21);
+    check_insert(24, 26);
+    check_insert(2, 25);
+    assert(nodes[root].start == 1 && nodes[root].end == 26);
+
+    clear();
+    memset(expected, 0, MASK_LEN);
+    check_insert(1, 1);
+    check_insert(3, 3);
+    check_insert(5, 5);
+    check_insert(6, 6);
+    check_insert(9, 12);
+    check_insert(14, 16);
+    check_insert(13, 18);
+    check_insert(2, 2);
+
+    // All the nodes dropped on the way were reused
+    assert(len <= 6);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (int op = 0; op < 20; ++op) {
+            i16 start = rand() % START_RAND;
+            i16 end = start + rand() % SIZE_RAND;
+
+            check_insert(start, end);
+        }
+    }
+}
+
+void test_sorted()
+{
+    for (int test = 0; test < 100; ++test) {
+        srand(test);
+        clear();
+        memset(expected, 0, MASK_LEN);
+
+        for (i16 start = 0; start < TEST_MAX_VAL; start += 1 + rand() % 3)
+            check_insert(start, start + rand() % 2);
+    }
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+    test_sorted();
+
+#ifdef STATS
+    stats_dump("diet_treap", &stats);
+#endif
+
+    printf("diet_treap: all tests passed\n");
+}
+
+#endif
@@ -0,0 +1,162 @@
+// Bounded coverage counting for one column: how many layers cover every
+// pixel, up to K, kept as runs of equal count in the valued interval map
+// from diet_map.c
+//
+// An insert reports the runs where the coverage goes from c to c + 1 with
+// c < K, so a span renderer can composite up to K translucent layers per
+// pixel front to back without per-pixel lists. Pixels already at K are
+// left alone
+
+#ifndef NO_MAIN
+#define KCOVER_MAIN
+#define NO_MAIN
+#endif
+
+#include "diet_map.c"
+
+#ifndef K
+#define K 4
+#endif
+
+// [start, end] was covered by c layers, the span being inserted is layer c
+void layer(i16 start, i16 end, i16 c);
+
+struct kc_insert {
+    i16 tree;
+    // Raised pieces are reported keyed by their old count, so a run only
+    // grows while the count stays the same
+    struct coalescer layers;
+};
+
+// Counts one more layer over a piece of the span, unless it's saturated
+void count_layer(i16 start, i16 end, i16 c, void* ctx)
+{
+    struct kc_insert* ins = ctx;
+
+    // No layer covers a gap yet
+    if (c == NONE)
+        c = 0;
+
+    if (c >= K)
+        return;
+
+    ins->tree = assign(ins->tree, start, end, c + 1);
+    coalesce(&ins->layers, start, end, c);
+}
+
+// Adds one layer over [start, end], calling layer() for every run that was
+// below K. O((k + 1) log n) for k runs raised
+i16 kcover_insert(i16 tree, i16 start, i16 end)
+{
+    struct kc_insert ins = { tree, { layer, 0, -1, 0 } };
+
+    walk_runs(tree, start, end, count_layer, &ins);
+    coalesce_flush(&ins.layers);
+
+    return ins.tree;
+}
+
+#ifdef KCOVER_MAIN
+
+// Per-pixel counts to check against, NONE where nothing covers
+i16 counts[MASK_LEN];
+
+void layer(i16 start, i16 end, i16 c)
+{
+    record_run(start, end, c);
+}
+
+void clear()
+{
+    root = T;
+    len = 0;
+
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        counts[i] = NONE;
+}
+
+// Every pixel below K must be reported once with the count it had, and the
+// counts must saturate at K
+void check_insert(i16 start, i16 end)
+{
+    i16 raised[MASK_LEN];
+
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        raised[i] = NONE;
+
+    for (i16 i = start; i <= end; ++i) {
+        i16 c = counts[i] == NONE ? 0 : counts[i];
+
+        if (c < K) {
+            raised[i] = c;
+            counts[i] = c + 1;
+        }
+    }
+
+    num_runs = 0;
+    root = kcover_insert(root, start, end);
+
+    i16 reported[MASK_LEN];
+
+    runs_to_pixels(reported);
+    assert(memcmp(reported, raised, sizeof(raised)) == 0);
+
+    check_map(root, counts);
+}
+
+void test_cases()
+{
+    // Stacking the same span counts up to K, then stops reporting
+    clear();
+
+    for (int i = 0; i < K; ++i) {
+        check_insert(3, 9);
+        assert(num_runs == 1 && runs[0].key == i);
+    }
+
+    check_insert(3, 9);
+    assert(num_runs == 0);
+
+    // A wider span reports the saturated middle as nothing, and the sides
+    // as layer 0
+    check_insert(0, 12);
+    assert(num_runs == 2);
+    assert(runs[0].start == 0 && runs[0].end == 2 && runs[0].key == 0);
+    assert(runs[1].start == 10 && runs[1].end == 12 && runs[1].key == 0);
+
+    // Staggered spans split into runs of different counts
+    clear();
+    check_insert(0, 10);
+    check_insert(5, 15);
+    check_insert(0, 20);
+    assert(num_runs == 4);
+    assert(runs[0].key == 1 && runs[1].key == 2 && runs[2].key == 1 && runs[3].key == 0);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+
+        for (int op = 0; op < 40; ++op) {
+            i16 start = rand() % MASK_LEN;
+            i16 end = start + rand() % 12;
+
+            check_insert(start, end < MASK_LEN ? end : TEST_MAX_VAL);
+
+            if (len > N / 2)
+                map_gc();
+        }
+    }
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+
+    printf("kcover: all tests passed\n");
+}
+
+#endif
@@ -0,0 +1,849 @@
+// CPU reference of shaders/raycasting.comp
+// Renders the test world of engine/world.rs headlessly with the same DDA and
+// span projection. Every column either depth tests every pixel of every
+// span like the shader does, or inserts the spans into a per-column DIET
+// (diet3.c) and only draws the pixels that are not covered yet. Since the
+// DDA walks front to back, whatever the DIET blits is final: both DIET modes
+// stop a column once it is fully covered, and the nodepth mode also drops
+// the depth buffer
+//
+// The framebuffer is either row-major like the shader's image, or
+// column-major, where every span is a contiguous run that is filled with
+// vector stores and a transpose pass produces the row-major image
+//
+// The open scene is the world of engine/world.rs, which has sky above every
+// column, so no column ever fills. The closed one adds a floor, a low
+// ceiling and two full height walls through the middle of the world, so
+// every column fills up at the latest at a wall, and the DIET modes skip
+// the cells behind it
+//
+//     raycast [-m depth|diet|nodepth|all] [-l row|col|all] [-s open|closed]
+//             [-w width] [-h height] [-j threads] [-f frames] [-o out.ppm]
+//             [-t trace.bin]
+
+#define NO_MAIN
+#define DIET_TLS _Thread_local
+#include "diet3.c"
+
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define u32 uint32_t
+
+// Columns handed out to a thread at a time, like a workgroup of the shader
+#define CHUNK 32
+
+enum mode {
+    MODE_DEPTH,
+    MODE_DIET,
+    MODE_NODEPTH,
+    NUM_MODES,
+};
+
+const char* mode_names[NUM_MODES] = { "depth", "diet", "nodepth" };
+
+enum layout {
+    LAYOUT_ROW,
+    LAYOUT_COL,
+    NUM_LAYOUTS,
+};
+
+const char* layout_names[NUM_LAYOUTS] = { "row", "col" };
+
+enum scene {
+    SCENE_OPEN,
+    SCENE_CLOSED,
+    NUM_SCENES,
+};
+
+const char* scene_names[NUM_SCENES] = { "open", "closed" };
+
+// As wide as the target's integer vectors, wider ones are split badly
+#ifdef __AVX2__
+#define LANES 8
+#else
+#define LANES 4
+#endif
+
+typedef u32 u32xN __attribute__((vector_size(LANES * sizeof(u32))));
+typedef float f32xN __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t i32xN __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+// Tile size of the transpose pass
+#define TILE 32
+
+struct world {
+    u32 sx;
+    u32 sy;
+    u32 sz;
+    // Span list length per (x, z), and (bot, top) pairs along y, laid out
+    // like World::sizes() and World::spans()
+    u32* sizes;
+    u32* spans;
+};
+
+struct camera {
+    float pos[3];
+    float dir[2];
+    float plane[2];
+};
+
+struct frame {
+    int width;
+    int height;
+    enum layout layout;
+    u32* color;
+    // NULL in nodepth mode
+    float* depth;
+    // Row-major result, the color buffer itself unless it is column-major
+    u32* image;
+};
+
+struct frame_stats {
+    long spans;
+    long tested;
+    long written;
+    long cells;
+};
+
+struct job {
+    struct world* world;
+    struct camera* camera;
+    struct frame* frame;
+    enum mode mode;
+    atomic_int next_column;
+    struct trace* traces;
+};
+
+struct worker {
+    pthread_t thread;
+    struct job* job;
+    struct frame_stats stats;
+    struct trace* trace;
+};
+
+// What the DIET's blit callback draws into
+_Thread_local struct {
+    struct frame* frame;
+    struct frame_stats* stats;
+    int column;
+    u32 color;
+    float depth;
+} target;
+
+struct wyhash64 {
+    uint64_t state;
+};
+
+uint64_t wyhash64_gen(struct wyhash64* rng)
+{
+    rng->state += 0x60bee2bee120fc15;
+
+    unsigned __int128 t = (unsigned __int128)rng->state * 0xa3b195354a39b70d;
+    uint64_t m = (t >> 64) ^ t;
+    unsigned __int128 y = (unsigned __int128)m * 0x1b03738712fad5c9;
+
+    return (y >> 64) ^ y;
+}
+
+uint64_t wyhash64_gen_in_range(struct wyhash64* rng, uint64_t min, uint64_t max)
+{
+    return min + wyhash64_gen(rng) % (max - min);
+}
+
+void add_sphere(uint8_t* voxels, struct world* w, int64_t x, int64_t y, int64_t z, int64_t r)
+{
+    int64_t x_max = x + r < w->sx ? x + r : w->sx;
+    int64_t y_max = y + r < w->sy ? y + r : w->sy;
+    int64_t z_max = z + r < w->sz ? z + r : w->sz;
+
+    for (int64_t dx = x > r ? x - r : 0; dx < x_max; ++dx)
+        for (int64_t dy = y > r ? y - r : 0; dy < y_max; ++dy)
+            for (int64_t dz = z > r ? z - r : 0; dz < z_max; ++dz) {
+                int64_t ox = dx - x;
+                int64_t oy = dy - y;
+                int64_t oz = dz - z;
+
+                if (ox * ox + oy * oy + oz * oz <= r * r)
+                    voxels[(dz * w->sy + dy) * w->sx + dx] = 1;
+            }
+}
+
+// Floor and ceiling slabs, and walls at x = sx / 2 and z = sz / 2. Spans
+// only end at an empty voxel, so the top layer stays empty
+void close_world(uint8_t* voxels, struct world* w)
+{
+    for (u32 x = 0; x < w->sx; ++x)
+        for (u32 z = 0; z < w->sz; ++z) {
+            bool wall = x == w->sx / 2 || z == w->sz / 2;
+
+            for (u32 y = 0; y < w->sy - 1; ++y)
+                if (wall || y < 16 || y >= 64)
+                    voxels[(z * w->sy + y) * w->sx + x] = 1;
+        }
+}
+
+// Same world as World::new(): 50 spheres from a fixed seed, and a couple of
+// single voxels, converted to span lists
+void create_world(struct world* w, u32 sx, u32 sy, u32 sz, enum scene scene)
+{
+    uint8_t* voxels = calloc(sx * sy * sz, 1);
+    struct wyhash64 rng = { 0xcafebabe };
+
+    w->sx = sx;
+    w->sy = sy;
+    w->sz = sz;
+
+    for (int i = 0; i < 50; ++i) {
+        uint64_t r = wyhash64_gen_in_range(&rng, 3, 25);
+        uint64_t x = wyhash64_gen_in_range(&rng, 0, sx);
+        uint64_t y = wyhash64_gen_in_range(&rng, 0, sy);
+        uint64_t z = wyhash64_gen_in_range(&rng, 0, sz);
+
+        add_sphere(voxels, w, x, y, z, r);
+    }
+
+    voxels[((sz / 2 - 3) * sy + 20) * sx + 20] = 1;
+    voxels[((sz / 2 - 3) * sy + sy / 2) * sx + sx / 2] = 1;
+
+    if (scene == SCENE_CLOSED)
+        close_world(voxels, w);
+
+    w->sizes = calloc(sx * sz, sizeof(u32));
+    w->spans = calloc(sx * sy * sz, sizeof(u32));
+
+    for (u32 x = 0; x < sx; ++x)
+        for (u32 z = 0; z < sz; ++z) {
+            bool inside = voxels[(z * sy + 0) * sx + x] > 0;
+            u32 bot = 0;
+
+            for (u32 y = 1; y < sy; ++y) {
+                bool solid = voxels[(z * sy + y) * sx + x] > 0;
+
+                if (!solid && inside) {
+                    u32* len = &w->sizes[z * sx + x];
+
+                    w->spans[(z * sy + *len * 2 + 0) * sx + x] = bot;
+                    w->spans[(z * sy + *len * 2 + 1) * sx + x] = y;
+                    *len += 1;
+                    inside = false;
+                } else if (solid && !inside) {
+                    bot = y;
+                    inside = true;
+                }
+            }
+        }
+
+    free(voxels);
+}
+
+// The starting view of MainLoop: the corner of the world, looking along the
+// diagonal
+void create_camera(struct camera* c, float aspect_ratio)
+{
+    float fov_y = 70.0 * M_PI / 180.0;
+    float ang = M_PI_2 + M_PI_4;
+    float plane_len = tanf(fov_y / 2) * aspect_ratio;
+
+    c->pos[0] = 0;
+    c->pos[1] = 0;
+    c->pos[2] = 0;
+    c->dir[0] = sinf(ang);
+    c->dir[1] = -cosf(ang);
+    c->plane[0] = sinf(ang + M_PI_2) * plane_len;
+    c->plane[1] = -cosf(ang + M_PI_2) * plane_len;
+}
+
+void clear_frame(struct frame* f)
+{
+    for (int i = 0; i < f->width * f->height; ++i) {
+        f->color[i] = 0;
+
+        if (f->depth)
+            f->depth[i] = 1;
+    }
+}
+
+u32 pack_color(float r, float g, float b)
+{
+    return (u32)lrintf(r * 255) | (u32)lrintf(g * 255) << 8 | (u32)lrintf(b * 255) << 16
+        | 0xffu << 24;
+}
+
+void draw_depth_tested(struct frame* f, struct frame_stats* st, int column, int ymin, int ymax,
+        u32 color, float depth)
+{
+    for (int y = ymin; y <= ymax; ++y) {
+        int p = y * f->width + column;
+
+        st->tested++;
+
+        if (depth < f->depth[p]) {
+            f->color[p] = color;
+            f->depth[p] = depth;
+            st->written++;
+        }
+    }
+}
+
+// Depth tests a run of a column-major column, LANES pixels at a time
+void fill_depth_tested(struct frame* f, struct frame_stats* st, int column, int ymin, int ymax,
+        u32 color, float depth)
+{
+    u32* cp = f->color + column * f->height;
+    float* dp = f->depth + column * f->height;
+    int y = ymin;
+
+    st->tested += ymax - ymin + 1;
+
+    if (ymax - ymin + 1 >= LANES) {
+        u32xN cv = color - (u32xN){ 0 };
+        f32xN dv = depth - (f32xN){ 0 };
+        i32xN written = { 0 };
+
+        for (; y + LANES - 1 <= ymax; y += LANES) {
+            u32xN c;
+            f32xN d;
+
+            memcpy(&c, cp + y, sizeof(c));
+            memcpy(&d, dp + y, sizeof(d));
+
+            i32xN nearer = dv < d;
+
+            c = (c & ~(u32xN)nearer) | (cv & (u32xN)nearer);
+            d = (f32xN)(((i32xN)d & ~nearer) | ((i32xN)dv & nearer));
+
+            memcpy(cp + y, &c, sizeof(c));
+            memcpy(dp + y, &d, sizeof(d));
+
+            written -= nearer;
+        }
+
+        for (int i = 0; i < LANES; ++i)
+            st->written += written[i];
+    }
+
+    for (; y <= ymax; ++y) {
+        if (depth < dp[y]) {
+            cp[y] = color;
+            dp[y] = depth;
+            st->written++;
+        }
+    }
+}
+
+// Only for pixels known to be uncovered. Column-major runs are contiguous,
+// so the compiler turns the loop into vector stores
+void fill(struct frame* f, struct frame_stats* st, int column, int ymin, int ymax, u32 color)
+{
+    st->written += ymax - ymin + 1;
+
+    if (f->layout == LAYOUT_COL) {
+        u32* cp = f->color + column * f->height;
+
+        for (int y = ymin; y <= ymax; ++y)
+            cp[y] = color;
+    } else {
+        for (int y = ymin; y <= ymax; ++y)
+            f->color[y * f->width + column] = color;
+    }
+}
+
+void draw(struct frame* f, struct frame_stats* st, int column, int ymin, int ymax, u32 color,
+        float depth)
+{
+    if (!f->depth)
+        fill(f, st, column, ymin, ymax, color);
+    else if (f->layout == LAYOUT_COL)
+        fill_depth_tested(f, st, column, ymin, ymax, color, depth);
+    else
+        draw_depth_tested(f, st, column, ymin, ymax, color, depth);
+}
+
+void transpose(struct frame* f)
+{
+    for (int x0 = 0; x0 < f->width; x0 += TILE)
+        for (int y0 = 0; y0 < f->height; y0 += TILE)
+            for (int x = x0; x < x0 + TILE && x < f->width; ++x)
+                for (int y = y0; y < y0 + TILE && y < f->height; ++y)
+                    f->image[y * f->width + x] = f->color[x * f->height + y];
+}
+
+void debug_insert(i16 start, i16 end)
+{
+}
+
+void blit(i16 start, i16 end)
+{
+    draw(target.frame, target.stats, target.column, start, end, target.color,
+            target.depth);
+}
+
+// Float to int like the shader, without the undefined behaviour of
+// converting infinities when a ray starts on a cell boundary
+int to_row(float y)
+{
+    if (!(y > -1e6))
+        return -1000000;
+
+    if (!(y < 1e6))
+        return 1000000;
+
+    return (int)y;
+}
+
+void emit_span(struct job* job, struct worker* w, int column, int ymin, int ymax, u32 color,
+        float perp_dist)
+{
+    struct frame* f = job->frame;
+
+    if (ymin >= f->height || ymax < 0)
+        return;
+
+    ymin = ymin > 0 ? ymin : 0;
+    ymax = ymax < f->height - 1 ? ymax : f->height - 1;
+
+    if (ymin > ymax)
+        return;
+
+    float depth = perp_dist / 1000;
+
+    w->stats.spans++;
+
+    if (job->mode == MODE_DEPTH) {
+        draw(f, &w->stats, column, ymin, ymax, color, depth);
+        return;
+    }
+
+    if (w->trace)
+        trace_push(w->trace, column, TRACE_INSERT, ymin, ymax);
+
+    // Garbage from path copying piles up in tall, busy columns
+    if (len > N / 2)
+        diet_gc();
+
+    target.color = color;
+    target.depth = depth;
+
+    root = insert_range(root, ymin, ymax);
+}
+
+void render_column(struct job* job, struct worker* w, int column)
+{
+    struct world* world = job->world;
+    struct camera* c = job->camera;
+    struct frame* f = job->frame;
+
+    float hover = 32.0;
+    float scale = 512.0;
+    float horizon = 384.0;
+
+    float xnorm = 2.0f * column / f->width - 1.0f;
+    float ray_dir[2] = { c->dir[0] + c->plane[0] * xnorm, c->dir[1] + c->plane[1] * xnorm };
+    float delta_dist[2] = { fabsf(1.0f / ray_dir[0]), fabsf(1.0f / ray_dir[1]) };
+    int map_step[2] = { (ray_dir[0] > 0) - (ray_dir[0] < 0), (ray_dir[1] > 0) - (ray_dir[1] < 0) };
+    int map_pos[2] = { (int)c->pos[0], (int)c->pos[2] };
+    float dist[2];
+    int side;
+
+    dist[0] = (map_step[0] * (map_pos[0] - c->pos[0]) + (map_step[0] + 1.0f) / 2) * delta_dist[0];
+    dist[1] = (map_step[1] * (map_pos[1] - c->pos[2]) + (map_step[1] + 1.0f) / 2) * delta_dist[1];
+
+    if (job->mode != MODE_DEPTH) {
+        root = T;
+        len = 0;
+        target.frame = f;
+        target.stats = &w->stats;
+        target.column = column;
+
+        if (w->trace)
+            trace_push(w->trace, column, TRACE_CLEAR, 0, 0);
+    }
+
+    while (1) {
+        if (dist[0] < dist[1]) {
+            dist[0] += delta_dist[0];
+            map_pos[0] += map_step[0];
+            side = 0;
+        } else {
+            dist[1] += delta_dist[1];
+            map_pos[1] += map_step[1];
+            side = 1;
+        }
+
+        if (map_pos[0] < 0 || map_pos[1] < 0 || map_pos[0] >= (int)world->sx
+                || map_pos[1] >= (int)world->sz)
+            break;
+
+        w->stats.cells++;
+
+        float perp_dist = side == 0 ? dist[0] - delta_dist[0] : dist[1] - delta_dist[1];
+        u32 color = side == 0 ? pack_color(0.6, 0.6, 0.6) : pack_color(1.0, 1.0, 1.0);
+
+        u32 x = map_pos[0];
+        u32 z = map_pos[1];
+        u32 num_spans = world->sizes[z * world->sx + x];
+
+        if (num_spans == 0)
+            continue;
+
+        for (u32 n = 0; n < num_spans; ++n) {
+            u32 bot = world->spans[(z * world->sy + n * 2 + 0) * world->sx + x];
+            u32 top = world->spans[(z * world->sy + n * 2 + 1) * world->sx + x];
+
+            int ymin = to_row((hover - top) * scale / perp_dist + horizon);
+            int ymax = to_row((hover - bot) * scale / perp_dist + horizon);
+
+            emit_span(job, w, column, ymin, ymax, color, perp_dist);
+        }
+
+        // One more step for floor and ceilings
+        float cdist[2] = { dist[0], dist[1] };
+
+        if (cdist[0] < cdist[1]) {
+            cdist[0] += delta_dist[0];
+            side = 0;
+        } else {
+            cdist[1] += delta_dist[1];
+            side = 1;
+        }
+
+        float next_dist = side == 0 ? cdist[0] - delta_dist[0] : cdist[1] - delta_dist[1];
+
+        u32 bot_point = world->spans[(z * world->sy + 0) * world->sx + x];
+        u32 top_point = world->spans[(z * world->sy + (num_spans - 1) * 2 + 1) * world->sx + x];
+
+        color = pack_color(0.8, 0.8, 0.8);
+
+        int ymin = to_row((hover - top_point) * scale / next_dist + horizon);
+        int ymax = to_row((hover - top_point) * scale / perp_dist + horizon);
+
+        emit_span(job, w, column, ymin, ymax, color, perp_dist);
+
+        ymin = to_row((hover - bot_point) * scale / perp_dist + horizon);
+        ymax = to_row((hover - bot_point) * scale / next_dist + horizon);
+
+        emit_span(job, w, column, ymin, ymax, color, perp_dist);
+
+        // Covered columns are a single interval
+        if (job->mode != MODE_DEPTH && root != T && nodes[root].start == 0
+                && nodes[root].end == f->height - 1)
+            break;
+    }
+}
+
+void* render_worker(void* arg)
+{
+    struct worker* w = arg;
+    struct job* job = w->job;
+    int width = job->frame->width;
+
+    while (1) {
+        int first = atomic_fetch_add(&job->next_column, CHUNK);
+
+        if (first >= width)
+            break;
+
+        for (int column = first; column < first + CHUNK && column < width; ++column)
+            render_column(job, w, column);
+    }
+
+    diet_free();
+
+    return NULL;
+}
+
+double now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+double render(struct job* job, struct worker* workers, int num_threads,
+        struct frame_stats* stats)
+{
+    double start = now();
+
+    clear_frame(job->frame);
+    atomic_store(&job->next_column, 0);
+
+    for (int t = 0; t < num_threads; ++t) {
+        workers[t].job = job;
+        workers[t].trace = job->traces ? &job->traces[t] : NULL;
+        memset(&workers[t].stats, 0, sizeof(struct frame_stats));
+
+        pthread_create(&workers[t].thread, NULL, render_worker, &workers[t]);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (int t = 0; t < num_threads; ++t) {
+        pthread_join(workers[t].thread, NULL);
+
+        stats->spans += workers[t].stats.spans;
+        stats->tested += workers[t].stats.tested;
+        stats->written += workers[t].stats.written;
+        stats->cells += workers[t].stats.cells;
+    }
+
+    if (job->frame->layout == LAYOUT_COL)
+        transpose(job->frame);
+
+    return now() - start;
+}
+
+long covered_pixels(struct frame* f)
+{
+    long covered = 0;
+
+    for (int i = 0; i < f->width * f->height; ++i)
+        covered += f->image[i] != 0;
+
+    return covered;
+}
+
+void write_ppm(const char* path, struct frame* f)
+{
+    FILE* file = fopen(path, "wb");
+
+    if (!file) {
+        perror(path);
+        return;
+    }
+
+    fprintf(file, "P6\n%d %d\n255\n", f->width, f->height);
+
+    for (int i = 0; i < f->width * f->height; ++i) {
+        uint8_t rgb[3] = { f->image[i], f->image[i] >> 8, f->image[i] >> 16 };
+
+        fwrite(rgb, 1, 3, file);
+    }
+
+    fclose(file);
+}
+
+void create_frame(struct frame* f, int width, int height, enum layout layout, bool depth)
+{
+    f->width = width;
+    f->height = height;
+    f->layout = layout;
+    f->color = malloc(width * height * sizeof(u32));
+    f->depth = depth ? malloc(width * height * sizeof(float)) : NULL;
+    f->image = layout == LAYOUT_COL ? malloc(width * height * sizeof(u32)) : f->color;
+}
+
+void destroy_frame(struct frame* f)
+{
+    if (f->image != f->color)
+        free(f->image);
+
+    free(f->color);
+    free(f->depth);
+}
+
+void usage(const char* argv0)
+{
+    fprintf(stderr, "usage: %s [-m depth|diet|nodepth|all] [-l row|col|all] "
+            "[-s open|closed] [-w width] [-h height] [-j threads] [-f frames] "
+            "[-o out.ppm] [-t trace.bin]\n", argv0);
+}
+
+// Sets [*first, *last] to the choice named arg, or to all of them for
+// "all". False for an unknown name
+bool parse_choice(const char* arg, const char** names, int num, int* first, int* last)
+{
+    if (strcmp(arg, "all") == 0) {
+        *first = 0;
+        *last = num - 1;
+        return true;
+    }
+
+    for (int i = 0; i < num; ++i)
+        if (strcmp(arg, names[i]) == 0) {
+            *first = *last = i;
+            return true;
+        }
+
+    return false;
+}
+
+int main(int argc, char** argv)
+{
+    int width = 1024;
+    int height = 768;
+    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_frames = 10;
+    const char* out_path = NULL;
+    const char* trace_path = NULL;
+    int first_mode = 0;
+    int last_mode = NUM_MODES - 1;
+    int first_layout = 0;
+    int last_layout = NUM_LAYOUTS - 1;
+    enum scene scene = SCENE_OPEN;
+    int s;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:l:s:w:h:j:f:o:t:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (!parse_choice(optarg, mode_names, NUM_MODES, &first_mode, &last_mode)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'l':
+            if (!parse_choice(optarg, layout_names, NUM_LAYOUTS, &first_layout,
+                        &last_layout)) {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 's':
+            if (!parse_choice(optarg, scene_names, NUM_SCENES, &s, &s)) {
+                usage(argv[0]);
+                return 1;
+            }
+            scene = s;
+            break;
+        case 'w': width = atoi(optarg); break;
+        case 'h': height = atoi(optarg); break;
+        case 'j': num_threads = atoi(optarg); break;
+        case 'f': num_frames = atoi(optarg); break;
+        case 'o': out_path = optarg; break;
+        case 't': trace_path = optarg; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (height >= T) {
+        fprintf(stderr, "height must be below %d\n", T);
+        return 1;
+    }
+
+    struct world world;
+    struct camera camera;
+    struct frame reference;
+    struct frame frame;
+    struct worker *workers = calloc(num_threads, sizeof(struct worker));
+    double best_times[NUM_MODES][NUM_LAYOUTS];
+    double depth_bytes[NUM_MODES];
+    long cells[NUM_MODES];
+    bool first = true;
+
+    create_world(&world, 256, 128, 256, scene);
+    create_camera(&camera, (float)width / height);
+
+    printf("%dx%d, %s scene, %d threads, %d frames\n", width, height, scene_names[scene],
+            num_threads, num_frames);
+
+    for (int m = first_mode; m <= last_mode; ++m)
+        for (int l = first_layout; l <= last_layout; ++l) {
+            struct job job = { &world, &camera, &frame, m, 0, NULL };
+            struct frame_stats stats;
+            double best = INFINITY;
+            double total = 0;
+
+            create_frame(&frame, width, height, l, m != MODE_NODEPTH);
+
+            for (int i = 0; i < num_frames; ++i) {
+                // Only the first frame is recorded
+                bool record = trace_path && m == MODE_DIET && i == 0;
+
+                if (record)
+                    job.traces = calloc(num_threads, sizeof(struct trace));
+
+                double t = render(&job, workers, num_threads, &stats);
+
+                best = t < best ? t : best;
+                total += t;
+
+                if (record) {
+                    if (trace_save(trace_path, job.traces, num_threads) != 0)
+                        perror(trace_path);
+
+                    for (int t = 0; t < num_threads; ++t)
+                        trace_free(&job.traces[t]);
+
+                    free(job.traces);
+                    job.traces = NULL;
+                    trace_path = NULL;
+                }
+            }
+
+            long covered = covered_pixels(&frame);
+
+            // Clear, then a read per tested pixel and a write per written one
+            depth_bytes[m] = 0;
+
+            if (frame.depth)
+                depth_bytes[m] = (double)(width * height + stats.tested + stats.written)
+                    * sizeof(float);
+
+            best_times[m][l] = best;
+            cells[m] = stats.cells;
+
+            long drawn = frame.depth ? stats.tested : stats.written;
+
+            printf("%-7s %s best=%.3fms avg=%.3fms cells=%ld spans=%ld tested=%ld "
+                    "written=%ld covered=%ld overdraw=%.2f depth_traffic=%.2fMB\n",
+                    mode_names[m], layout_names[l], best * 1e3, total / num_frames * 1e3,
+                    stats.cells, stats.spans, stats.tested, stats.written, covered,
+                    covered ? (double)drawn / covered : 0,
+                    depth_bytes[m] / 1e6);
+
+            if (first) {
+                create_frame(&reference, width, height, LAYOUT_ROW, false);
+                memcpy(reference.image, frame.image, width * height * sizeof(u32));
+                first = false;
+            } else {
+                long differing = 0;
+
+                for (int i = 0; i < width * height; ++i)
+                    differing += reference.image[i] != frame.image[i];
+
+                if (differing)
+                    printf("  %ld pixels differ from %s %s\n", differing,
+                            mode_names[first_mode], layout_names[first_layout]);
+            }
+
+            // The last configuration rendered is the one written out
+            if (out_path && m == last_mode && l == last_layout)
+                write_ppm(out_path, &frame);
+
+            destroy_frame(&frame);
+        }
+
+    if (first_mode < MODE_NODEPTH && last_mode == MODE_NODEPTH)
+        for (int l = first_layout; l <= last_layout; ++l)
+            for (int m = first_mode; m < MODE_NODEPTH; ++m) {
+                double saved = best_times[m][l] - best_times[MODE_NODEPTH][l];
+
+                printf("nodepth vs %s (%s): saves %.3fms (%.1f%%) and %.2fMB of depth "
+                        "traffic per frame\n", mode_names[m], layout_names[l], saved * 1e3,
+                        100 * saved / best_times[m][l], depth_bytes[m] / 1e6);
+            }
+
+    // Only the DIET modes stop at full columns, the depth mode walks every
+    // cell up to the edge of the world
+    if (first_mode == MODE_DEPTH)
+        for (int m = MODE_DEPTH + 1; m <= last_mode; ++m)
+            printf("%s vs depth: termination skips %ld of %ld cells (%.1f%%)\n",
+                    mode_names[m], cells[MODE_DEPTH] - cells[m], cells[MODE_DEPTH],
+                    100.0 * (cells[MODE_DEPTH] - cells[m]) / cells[MODE_DEPTH]);
+
+    destroy_frame(&reference);
+    free(workers);
+    free(world.sizes);
+    free(world.spans);
+}
@@ -0,0 +1,332 @@
+// Replays a span trace (see trace.h) against one of the tree experiments
+// and times it. The backend is picked at build time, e.g. replay_diet3 is
+// built with -DBACKEND_diet3 and includes diet3.c without its tests
+//
+//     replay_diet3 trace.bin              replay a trace
+//     replay_diet3 gen trace.bin          write a synthetic trace to replay
+//     replay_diet3 gen-sorted trace.bin   same, with spans sorted by start
+//
+// The DIET backends (diet3, diet_treap, diet_splay, diet_scapegoat) are
+// blit-exact: they blit only the pixels no earlier span covered, so they
+// print the same pixel and hit totals for the same trace. The other two
+// don't:
+// - diet is the first prototype, and its gap blitting still drops some
+//   pixels (see the TODOs in diet.c), so it reports fewer
+// - avl_tree_ref is an interval tree that keeps overlapping intervals and
+//   never blits, so it reports 0 pixels. Only its timing and hits compare
+
+#define NO_MAIN
+
+#if defined(BACKEND_diet3)
+
+#include "diet3.c"
+
+const char* backend_name = "diet3";
+
+void debug_insert(i16 start, i16 end)
+{
+}
+
+void backend_clear()
+{
+    root = T;
+    len = 0;
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    // Path copying leaves garbage behind, a long column may need a sweep
+    if (len > N / 2)
+        diet_gc();
+
+    root = insert_range(root, start, end);
+
+    STAT(stat_insert_done(&stats));
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    i16 x = root;
+
+    while (x != T) {
+        if (end < nodes[x].start)
+            x = nodes[x].left;
+        else if (start > nodes[x].end)
+            x = nodes[x].right;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+#elif defined(BACKEND_diet_treap)
+
+#include "diet_treap.c"
+
+const char* backend_name = "diet_treap";
+
+void backend_clear()
+{
+    clear();
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    insert(start, end);
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    i16 x = root;
+
+    while (x != T) {
+        if (end < nodes[x].start)
+            x = nodes[x].left;
+        else if (start > nodes[x].end)
+            x = nodes[x].right;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+#elif defined(BACKEND_diet_splay)
+
+#include "diet_splay.c"
+
+const char* backend_name = "diet_splay";
+
+void backend_clear()
+{
+    clear();
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    insert(start, end);
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    return query(start, end);
+}
+
+#elif defined(BACKEND_diet_scapegoat)
+
+#include "diet_scapegoat.c"
+
+const char* backend_name = "diet_scapegoat";
+
+void backend_clear()
+{
+    clear();
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    insert(start, end);
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    i16 x = root;
+
+    while (x != T) {
+        if (end < nodes[x].start)
+            x = nodes[x].left;
+        else if (start > nodes[x].end)
+            x = nodes[x].right;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+#elif defined(BACKEND_diet)
+
+#include "diet.c"
+
+const char* backend_name = "diet";
+
+void backend_clear()
+{
+    root = T;
+    len = 0;
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    root = insert_range(root, start, end);
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    i16 x = root;
+
+    while (x != T) {
+        if (end < nodes[x].low)
+            x = nodes[x].left;
+        else if (start > nodes[x].high)
+            x = nodes[x].right;
+        else
+            return true;
+    }
+
+    return false;
+}
+
+#elif defined(BACKEND_avl_tree_ref)
+
+#include "avl_tree_ref.c"
+
+const char* backend_name = "avl_tree_ref";
+
+void backend_clear()
+{
+    root = T;
+    high_root = T;
+    len = 0;
+}
+
+void backend_insert(i16 start, i16 end)
+{
+    insert(start, end);
+}
+
+bool backend_query(i16 start, i16 end)
+{
+    return search(start, end) != T;
+}
+
+#else
+#error "Unknown backend, build with -DBACKEND_<name>"
+#endif
+
+#include <time.h>
+
+#include "trace.h"
+
+long blit_pixels = 0;
+
+void blit(i16 start, i16 end)
+{
+    blit_pixels += end - start + 1;
+}
+
+double replay_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int compare_records(const void* a, const void* b)
+{
+    const struct trace_record* x = a;
+    const struct trace_record* y = b;
+
+    return x->start - y->start;
+}
+
+void generate(const char* path, int columns, bool sorted)
+{
+    struct trace t = { 0 };
+    int height = 240;
+
+    srand(1);
+
+    for (int c = 0; c < columns; ++c) {
+        trace_push(&t, c, TRACE_CLEAR, 0, 0);
+
+        long first = t.len;
+        int num_spans = 10 + rand() % 50;
+
+        for (int i = 0; i < num_spans; ++i) {
+            int start = rand() % height;
+            int end = start + rand() % (height / 8);
+            int op = i % 4 == 3 ? TRACE_QUERY : TRACE_INSERT;
+
+            trace_push(&t, c, op, start, end < height ? end : height - 1);
+        }
+
+        if (sorted)
+            qsort(&t.records[first], t.len - first, sizeof(struct trace_record),
+                    compare_records);
+    }
+
+    if (trace_save(path, &t, 1) != 0) {
+        perror(path);
+        exit(1);
+    }
+
+    printf("wrote %ld records for %d columns to %s\n", t.len, columns, path);
+
+    trace_free(&t);
+}
+
+void replay(const char* path)
+{
+    struct trace t = { 0 };
+
+    if (trace_load(path, &t) != 0) {
+        fprintf(stderr, "%s: can't load trace\n", path);
+        exit(1);
+    }
+
+    long inserts = 0;
+    long queries = 0;
+    long hits = 0;
+
+    backend_clear();
+
+    double start = replay_now();
+
+    for (long i = 0; i < t.len; ++i) {
+        struct trace_record* r = &t.records[i];
+
+        switch (r->op) {
+        case TRACE_CLEAR:
+            backend_clear();
+            break;
+        case TRACE_INSERT:
+            backend_insert(r->start, r->end);
+            inserts++;
+            break;
+        case TRACE_QUERY:
+            hits += backend_query(r->start, r->end);
+            queries++;
+            break;
+        }
+    }
+
+    double elapsed = replay_now() - start;
+
+    printf("%s: records=%ld inserts=%ld queries=%ld hits=%ld blit_pixels=%ld "
+            "time=%.3fms ns/op=%.1f\n", backend_name, t.len, inserts, queries, hits,
+            blit_pixels, elapsed * 1e3, elapsed * 1e9 / (t.len ? t.len : 1));
+
+#if defined(STATS) && !defined(BACKEND_diet)
+    stats_dump(backend_name, &stats);
+#endif
+
+    trace_free(&t);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "gen") == 0) {
+        generate(argv[2], 1920, false);
+    } else if (argc == 3 && strcmp(argv[1], "gen-sorted") == 0) {
+        generate(argv[2], 1920, true);
+    } else if (argc == 2) {
+        replay(argv[1]);
+    } else {
+        fprintf(stderr, "usage: %s [gen|gen-sorted] <trace>\n", argv[0]);
+        return 1;
+    }
+}
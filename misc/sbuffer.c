@@ -0,0 +1,161 @@
+// Span buffer (s-buffer) for one column: runs of (start, end, depth) kept in
+// the valued interval map from diet_map.c, with the depth as the value
+//
+// Unlike the DIETs, where the first writer wins, spans may arrive in any
+// order. An insert replaces only the parts of the column where it is nearer
+// than what's there (or where nothing is), and blits exactly those pixels.
+// On a tie the earlier span stays
+
+#ifndef NO_MAIN
+#define SBUFFER_MAIN
+#define NO_MAIN
+#endif
+
+#include "diet_map.c"
+
+void blit(i16 start, i16 end);
+
+// Every replaced piece gets the same key, so blits coalesce on touching alone
+void emit_blit(i16 start, i16 end, i16 key)
+{
+    blit(start, end);
+}
+
+struct sb_insert {
+    // Replacing assigns into a copy, the walk stays on the old tree
+    i16 tree;
+    i16 depth;
+    // Replaced pieces touching each other blit as one run
+    struct coalescer blits;
+};
+
+// Takes over a piece of the span if it's a gap or a farther run
+void replace_farther(i16 start, i16 end, i16 depth, void* ctx)
+{
+    struct sb_insert* ins = ctx;
+
+    if (depth != NONE && depth <= ins->depth)
+        return;
+
+    ins->tree = assign(ins->tree, start, end, ins->depth);
+    coalesce(&ins->blits, start, end, 0);
+}
+
+// Inserts [start, end] at a depth that must not be negative, blitting the
+// runs where it's visible. O((k + 1) log n) for k runs replaced
+i16 sbuffer_insert(i16 tree, i16 start, i16 end, i16 depth)
+{
+    struct sb_insert ins = { tree, depth, { emit_blit, 0, -1, 0 } };
+
+    assert(depth >= 0);
+
+    walk_runs(tree, start, end, replace_farther, &ins);
+    coalesce_flush(&ins.blits);
+
+    return ins.tree;
+}
+
+#ifdef SBUFFER_MAIN
+
+// What a per-pixel depth buffer would hold, to check against
+i16 depth_buffer[MASK_LEN];
+
+void blit(i16 start, i16 end)
+{
+    record_run(start, end, 0);
+}
+
+void clear()
+{
+    root = T;
+    len = 0;
+
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        depth_buffer[i] = NONE;
+}
+
+// The blits must be exactly the pixels the depth buffer changes, as
+// maximal runs in order
+void check_insert(i16 start, i16 end, i16 depth)
+{
+    i16 changed[MASK_LEN];
+
+    for (i16 i = 0; i < MASK_LEN; ++i)
+        changed[i] = NONE;
+
+    for (i16 i = start; i <= end; ++i) {
+        if (depth_buffer[i] == NONE || depth < depth_buffer[i]) {
+            depth_buffer[i] = depth;
+            changed[i] = 0;
+        }
+    }
+
+    num_runs = 0;
+    root = sbuffer_insert(root, start, end, depth);
+
+    i16 blitted[MASK_LEN];
+
+    runs_to_pixels(blitted);
+    assert(memcmp(blitted, changed, sizeof(changed)) == 0);
+
+    check_map(root, depth_buffer);
+}
+
+void test_cases()
+{
+    // Back to front: every span is visible where it overlaps the last one
+    clear();
+    check_insert(0, 20, 9);
+    check_insert(5, 10, 5);
+    assert(num_runs == 1 && runs[0].start == 5 && runs[0].end == 10);
+    check_insert(8, 15, 2);
+
+    // A far span only fills the holes around a near one
+    clear();
+    check_insert(10, 12, 1);
+    check_insert(20, 22, 1);
+    check_insert(5, 25, 7);
+    assert(num_runs == 3);
+
+    // A near span over several farther runs and gaps blits once
+    clear();
+    check_insert(2, 4, 8);
+    check_insert(7, 9, 6);
+    check_insert(12, 14, 9);
+    check_insert(0, 20, 3);
+    assert(num_runs == 1 && runs[0].start == 0 && runs[0].end == 20);
+
+    // Ties keep the earlier span
+    clear();
+    check_insert(0, 10, 4);
+    check_insert(0, 10, 4);
+    assert(num_runs == 0);
+}
+
+void test_random()
+{
+    for (int test = 0; test < 1000; ++test) {
+        srand(test);
+        clear();
+
+        for (int op = 0; op < 40; ++op) {
+            i16 start = rand() % MASK_LEN;
+            i16 end = start + rand() % 10;
+
+            check_insert(start, end < MASK_LEN ? end : TEST_MAX_VAL, rand() % 16);
+
+            if (len > N / 2)
+                map_gc();
+        }
+    }
+}
+
+int main()
+{
+    test_cases();
+    test_random();
+
+    printf("sbuffer: all tests passed\n");
+}
+
+#endif
@@ -0,0 +1,122 @@
+// Operation counters for the tree experiments
+// Compiled out unless STATS is defined (make STATS=1), so the counting
+// statements must only appear inside STAT() and STAT_FRAME()
+
+#ifndef STATS_H
+#define STATS_H
+
+#ifdef STATS
+
+#include <stdio.h>
+#include <string.h>
+
+#define HIST_LEN 16
+
+struct stats {
+    long inserts;
+    long nodes;
+    long rotations;
+    long blits;
+    long blit_pixels;
+    int depth;
+    int max_depth;
+    // Deepest frame and pixels blitted during the current insert
+    int insert_depth;
+    long insert_pixels;
+    // Per insert: recursion depth, and blit pixels in log2 buckets
+    long depth_hist[HIST_LEN];
+    long pixels_hist[HIST_LEN];
+};
+
+struct stat_frame {
+    struct stats* s;
+};
+
+#define STAT(x) do { x; } while (0)
+
+// Counts the enclosing function as one level of recursion until it returns
+#define STAT_FRAME(st) \
+    struct stat_frame stat_frame_ __attribute__((cleanup(stat_leave))) = stat_enter(&(st))
+
+static inline struct stat_frame stat_enter(struct stats* s)
+{
+    if (++s->depth > s->insert_depth)
+        s->insert_depth = s->depth;
+
+    return (struct stat_frame){ s };
+}
+
+static inline void stat_leave(struct stat_frame* f)
+{
+    f->s->depth--;
+}
+
+static inline void stat_blit(struct stats* s, int start, int end)
+{
+    s->blits++;
+    s->blit_pixels += end - start + 1;
+    s->insert_pixels += end - start + 1;
+}
+
+static inline int stat_bucket(long value)
+{
+    int b = 0;
+
+    while (value > 0 && b < HIST_LEN - 1) {
+        value >>= 1;
+        b++;
+    }
+
+    return b;
+}
+
+static inline void stat_insert_done(struct stats* s)
+{
+    s->inserts++;
+    s->depth_hist[s->insert_depth < HIST_LEN ? s->insert_depth : HIST_LEN - 1]++;
+    s->pixels_hist[stat_bucket(s->insert_pixels)]++;
+
+    if (s->insert_depth > s->max_depth)
+        s->max_depth = s->insert_depth;
+
+    s->insert_depth = 0;
+    s->insert_pixels = 0;
+}
+
+static inline void stats_reset(struct stats* s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+// Dumps the counters gathered since the last reset, e.g. once per frame
+static inline void stats_dump(const char* name, struct stats* s)
+{
+    long n = s->inserts > 0 ? s->inserts : 1;
+
+    printf("stats %s: inserts=%ld nodes=%ld (%.2f/insert) rotations=%ld (%.2f/insert) "
+            "max_depth=%d blits=%ld (%.2f/insert) blit_pixels=%ld (%.2f/insert)\n",
+            name, s->inserts, s->nodes, (double)s->nodes / n, s->rotations,
+            (double)s->rotations / n, s->max_depth, s->blits, (double)s->blits / n,
+            s->blit_pixels, (double)s->blit_pixels / n);
+
+    printf("  depth:");
+    for (int i = 0; i < HIST_LEN; ++i)
+        if (s->depth_hist[i])
+            printf(" %s%d:%ld", i == HIST_LEN - 1 ? ">=" : "", i, s->depth_hist[i]);
+    printf("\n");
+
+    printf("  pixels:");
+    for (int i = 0; i < HIST_LEN; ++i)
+        if (s->pixels_hist[i])
+            printf(" <%d:%ld", 1 << i, s->pixels_hist[i]);
+    printf("\n");
+}
+
+#else
+
+#define STAT(x) do { } while (0)
+#define STAT_FRAME(st)
+
+#endif
+
+#endif
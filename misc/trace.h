@@ -0,0 +1,111 @@
+// Binary traces of span workloads, for replaying real traffic against the
+// tree experiments
+//
+// A trace is a header followed by fixed-size records in native byte order.
+// Every column starts with TRACE_CLEAR, and its inserts and queries follow
+// until the next TRACE_CLEAR, so each column replays on a fresh tree
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE_MAGIC 0x52545053 // "SPTR"
+#define TRACE_VERSION 1
+
+enum trace_op {
+    TRACE_CLEAR,
+    TRACE_INSERT,
+    TRACE_QUERY,
+};
+
+struct trace_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_records;
+};
+
+struct trace_record {
+    uint16_t column;
+    uint8_t op;
+    uint8_t pad;
+    int16_t start;
+    int16_t end;
+};
+
+// Records are appended in memory, so every producer thread can keep its own
+// trace and save them all at the end of the frame
+struct trace {
+    struct trace_record* records;
+    long len;
+    long cap;
+};
+
+static inline void trace_push(struct trace* t, int column, int op, int start, int end)
+{
+    if (t->len == t->cap) {
+        t->cap = t->cap ? 2 * t->cap : 4096;
+        t->records = realloc(t->records, t->cap * sizeof(struct trace_record));
+    }
+
+    t->records[t->len++] = (struct trace_record){ column, op, 0, start, end };
+}
+
+static inline void trace_free(struct trace* t)
+{
+    free(t->records);
+    memset(t, 0, sizeof(*t));
+}
+
+// Writes the traces one after another. Each of them has to hold whole
+// columns for the result to replay correctly
+static inline int trace_save(const char* path, struct trace* traces, int num_traces)
+{
+    FILE* f = fopen(path, "wb");
+
+    if (!f)
+        return -1;
+
+    struct trace_header h = { TRACE_MAGIC, TRACE_VERSION, 0 };
+
+    for (int i = 0; i < num_traces; ++i)
+        h.num_records += traces[i].len;
+
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (int i = 0; i < num_traces; ++i)
+        fwrite(traces[i].records, sizeof(struct trace_record), traces[i].len, f);
+
+    return fclose(f);
+}
+
+static inline int trace_load(const char* path, struct trace* t)
+{
+    FILE* f = fopen(path, "rb");
+
+    if (!f)
+        return -1;
+
+    struct trace_header h;
+
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC
+            || h.version != TRACE_VERSION) {
+        fclose(f);
+        return -1;
+    }
+
+    t->len = h.num_records;
+    t->cap = h.num_records;
+    t->records = malloc(t->cap * sizeof(struct trace_record));
+
+    size_t read = fread(t->records, sizeof(struct trace_record), t->len, f);
+
+    fclose(f);
+
+    return read == (size_t)t->len ? 0 : -1;
+}
+
+#endif